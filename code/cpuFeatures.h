@@ -0,0 +1,111 @@
+#pragma once
+
+// Instruction sets of the CPU the sim is running on, checked at startup so kernels can use the widest one available.
+// The same binary then runs its best path on whatever machine it lands on
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+enum CpuFeatureLevel : u8
+{
+	CPU_LEVEL_SCALAR,
+	CPU_LEVEL_SSE2,
+	CPU_LEVEL_SSE41,
+	CPU_LEVEL_AVX2,
+	CPU_LEVEL_AVX512, // Foundation and byte/word instructions
+
+	CPU_LEVEL_COUNT
+};
+
+inline const char *CpuFeatureLevelToString(CpuFeatureLevel level)
+{
+	constexpr const char *LevelNames[CPU_LEVEL_COUNT] = {"Scalar", "SSE2", "SSE4.1", "AVX2", "AVX-512"};
+	Assert(level < CPU_LEVEL_COUNT);
+	return LevelNames[level];
+}
+
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+
+// Registers of a cpuid leaf, as eax, ebx, ecx, edx
+inline void GetCpuid(u32 leaf, u32 subleaf, u32 *outRegisters)
+{
+#if defined(_MSC_VER)
+	int registers[4];
+	__cpuidex(registers, (int)leaf, (int)subleaf);
+	for(u32 registerNum = 0; registerNum < 4; ++registerNum)
+	{
+		outRegisters[registerNum] = (u32)registers[registerNum];
+	}
+#else
+	__cpuid_count(leaf, subleaf, outRegisters[0], outRegisters[1], outRegisters[2], outRegisters[3]);
+#endif
+}
+
+// Register state the OS saves on context switches. Wide registers are only usable when it saves them
+inline u64 GetEnabledRegisterState()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	u32 low, high;
+	__asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+	return ((u64)high << 32) | low;
+#endif
+}
+
+inline CpuFeatureLevel DetectCpuFeatureLevel()
+{
+	u32 registers[4];
+	GetCpuid(0, 0, registers);
+	u32 maxLeaf = registers[0];
+
+	GetCpuid(1, 0, registers);
+	bool hasSSE2 = (registers[3] >> 26) & 1;
+	bool hasSSE41 = (registers[2] >> 19) & 1;
+	bool hasOSXSave = (registers[2] >> 27) & 1;
+	bool hasAVX = (registers[2] >> 28) & 1;
+
+	bool hasAVX2 = false;
+	bool hasAVX512 = false;
+	if(maxLeaf >= 7)
+	{
+		GetCpuid(7, 0, registers);
+		hasAVX2 = (registers[1] >> 5) & 1;
+		hasAVX512 = ((registers[1] >> 16) & 1) && ((registers[1] >> 30) & 1); // F and BW
+	}
+
+	u64 registerState = hasOSXSave ? GetEnabledRegisterState() : 0;
+	bool osSavesYmm = (registerState & 0x6) == 0x6;
+	bool osSavesZmm = (registerState & 0xe6) == 0xe6;
+
+	CpuFeatureLevel result = CPU_LEVEL_SCALAR;
+	if(hasAVX512 && hasAVX2 && hasAVX && osSavesZmm)
+	{
+		result = CPU_LEVEL_AVX512;
+	}
+	else if(hasAVX2 && hasAVX && osSavesYmm)
+	{
+		result = CPU_LEVEL_AVX2;
+	}
+	else if(hasSSE41 && hasSSE2)
+	{
+		result = CPU_LEVEL_SSE41;
+	}
+	else if(hasSSE2)
+	{
+		result = CPU_LEVEL_SSE2;
+	}
+	return result;
+}
+
+#else
+
+inline CpuFeatureLevel DetectCpuFeatureLevel()
+{
+	return CPU_LEVEL_SCALAR;
+}
+
+#endif
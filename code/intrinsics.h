@@ -0,0 +1,70 @@
+#pragma once
+
+// Thin wrappers over the compiler intrinsics the sim uses, so the same code builds with MSVC and GCC/Clang
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Index of the lowest set bit. Value must not be zero
+inline u32 CountTrailingZeros64(u64 value)
+{
+	Assert(value != 0);
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return (u32)index;
+#else
+	return (u32)__builtin_ctzll(value);
+#endif
+}
+
+// Number of zero bits above the highest set bit. Value must not be zero
+inline u32 CountLeadingZeros64(u64 value)
+{
+	Assert(value != 0);
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return 63 - (u32)index;
+#else
+	return (u32)__builtin_clzll(value);
+#endif
+}
+
+inline u32 CountSetBits64(u64 value)
+{
+#if defined(_MSC_VER)
+	// __popcnt64 needs a CPU with the POPCNT instruction, which x64 doesn't guarantee
+	value = value - ((value >> 1) & 0x5555555555555555ULL);
+	value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+	value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (u32)((value * 0x0101010101010101ULL) >> 56);
+#else
+	return (u32)__builtin_popcountll(value);
+#endif
+}
+
+// Read a word other threads may be setting bits in. No ordering, just a single untorn load
+inline u64 AtomicLoad64(u64 *value)
+{
+	return *(volatile u64 *)value;
+}
+
+inline void AtomicOr64(u64 *value, u64 bits)
+{
+#if defined(_MSC_VER)
+	_InterlockedOr64((volatile long long *)value, (long long)bits);
+#else
+	__atomic_fetch_or(value, bits, __ATOMIC_RELAXED);
+#endif
+}
+
+inline void AtomicAdd64(u64 *value, u64 amount)
+{
+#if defined(_MSC_VER)
+	_InterlockedExchangeAdd64((volatile long long *)value, (long long)amount);
+#else
+	__atomic_fetch_add(value, amount, __ATOMIC_RELAXED);
+#endif
+}
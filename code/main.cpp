@@ -5,6 +5,7 @@
 #include <cstdio> // for printf
 
 #include <stdlib.h>
+#include <algorithm> // for std::sort
 
 #define RAYMATH_IMPLEMENTATION
 #include "raylib/raymath.h"
@@ -19,6 +20,14 @@
 #pragma warning( pop )
 
 #include "hash.h"
+#include "intrinsics.h"
+#include "workerPool.h"
+#include "simRandom.h"
+#include "tileLayout.h"
+#include "materials.h"
+#include "margolus.h"
+#include "cpuFeatures.h"
+#include "simdScan.h"
 
 #include "main.h"
 
@@ -35,10 +44,68 @@ constexpr u32 gScreenHeight = 896;
 constexpr u8 SimPixelScale = 4;
 constexpr float gSimFPS = 120.0f;
 
+// Must be a power of two, as each region is stored as its own tile of pixels
 constexpr u32 gRegionSize = 64;
 
+// Store the pixels within each tile in Morton order rather than row major
+constexpr bool gTileMortonOrder = false;
+typedef TileLayout<gTileMortonOrder> PixelLayout;
+
+// Ring of tiles around the sim filled with boundary pixels, so kernels can look past the edge without bounds checks
+constexpr u32 GhostBorderTiles = 1;
+
+// Bounds checks on pixel accesses. Kernels rely on the ghost border instead, so release builds leave them out
+#if defined(NDEBUG)
+#define AssertPixelAccess(Expression)
+#else
+#define AssertPixelAccess(Expression) Assert(Expression)
+#endif
+
+// Threads used to update regions of a stage in parallel, including the main thread. Zero uses all hardware threads
+constexpr u32 gSimThreadCount = 0;
+
 constexpr u8 DirtyRectBufferCount = 2;
 
+// Furthest a region update can touch outside of its region: water velocity plus two pixels of dirty rect padding
+constexpr u32 MaxPixelReach = 7;
+
+// Step the sim so results are bit identical at any thread count, and log a hash of the pixel states every step
+constexpr bool gSimDeterministic = false;
+
+// Enough 64 bit words of random bits to cover the widest row a region scans, including padding
+constexpr u32 MaxRowRandomWords = 8;
+
+// Log2 of the side of the blocks materials are counted in, the level of the occupancy counts below regions.
+// Regions have to be a whole number of blocks
+constexpr u32 OccupancyBlockShift = 3;
+constexpr u32 OccupancyBlockSize = 1 << OccupancyBlockShift;
+
+// Update areas holding only powder a row at a time with bitwise ops, rather than pixel by pixel
+constexpr bool gBitSlicedPowder = true;
+
+// Pick each pixel's move from a table indexed by which of its neighbours it can move into, rather than testing moves in turn.
+// Neighbourhoods come from bit rows built with wide type compares, which are kept up to date as pixels move
+constexpr bool gNeighbourhoodLookup = true;
+
+// Steps a region has to go without any net material change before it stops being updated, so settled areas cost
+// nothing. Pixels sliding sideways within a row don't count as a change. Zero keeps every dirty region updating
+constexpr u32 gRegionSleepSteps = 32;
+
+// Besides its dirty rect, each region keeps a bit for every cell that changed, and each row is scanned just from the
+// first cell next to one of those to the last. Where there are few enough changes, the cells are visited one by one
+// instead. Visiting the cells around one change is reckoned to cost as much as scanning this many pixels.
+// Zero always scans whole rects
+constexpr u32 gChangedCellCost = 9;
+
+// Leave blocks holding nothing that moves out of the rows a region scans, going by the occupancy counts
+constexpr bool gSkipStaticBlocks = true;
+
+// How UpdateSim steps the sim to start with. F9 switches between the engines while running
+constexpr UpdateEngine gDefaultUpdateEngine = UPDATE_ENGINE_SCAN;
+
+// Start on the scalar kernels instead of the widest the CPU supports, to compare against. F8 toggles them while running
+constexpr bool gForceScalarKernels = false;
+
 
 struct DirtyRect
 {
@@ -49,172 +116,465 @@ struct DirtyRect
 };
 constexpr DirtyRect InvalidDirtyRect = {-1.0f, -1.0f, -1.0f, -1.0f};
 
-enum PixelType : u32
+inline bool AreDirtyRectsEqual(DirtyRect rectA, DirtyRect rectB)
+{
+	bool result = (rectA.minX == rectB.minX) &&
+		(rectA.minY == rectB.minY) &&
+		(rectA.maxX == rectB.maxX) &&
+		(rectA.maxY == rectB.maxY);
+	return result;
+}
+
+inline bool IsInvalidDirtyRect(DirtyRect rect)
+{
+	return AreDirtyRectsEqual(rect, InvalidDirtyRect);
+}
+
+inline bool IsPosInDirtyRect(Vector2 pos, DirtyRect rect)
+{
+	bool result = pos.x >= rect.minX && pos.x < rect.maxX &&
+		pos.y >= rect.minY && pos.y < rect.maxY;
+	return result;
+}
+
+// A pixel position along with its index into the sim planes, so it only has to be worked out once
+struct CellPos
 {
-	NONE = 0,
-	SAND = 1 << 0,
-	WATER = 1 << 1,
-	GAS = 1 << 2,
-	STONE = 1 << 3,
+	s32 x;
+	s32 y;
+	u32 index;
 };
 
-const char *PixelTypeToString(PixelType type)
+// Bit x of the result is bit (x - shift) of a row of words, carrying across words
+inline u64 GetRowBitsFromLeft(const u64 *rowBits, u32 wordIndex, u32 shift)
 {
-	const char *typeString = nullptr;
-	switch(type)
+	u64 result = rowBits[wordIndex] << shift;
+	if(wordIndex > 0)
 	{
-	case PixelType::NONE: typeString = "None"; break;
-	case PixelType::SAND: typeString = "Sand"; break;
-	case PixelType::WATER: typeString = "Water"; break;
-	case PixelType::GAS: typeString = "Gas"; break;
-	case PixelType::STONE: typeString = "Stone"; break;
-	default: Assert(false); // Need a string for this type!!
+		result |= rowBits[wordIndex - 1] >> (64 - shift);
 	}
-	return typeString;
+	return result;
 }
 
-Color GetTypeColor(PixelType type)
+// Bit x of the result is bit (x + shift) of a row of words, carrying across words
+inline u64 GetRowBitsFromRight(const u64 *rowBits, u32 wordIndex, u32 wordCount, u32 shift)
 {
-	Color result = BLANK;
-
-	int randValue = GetRandomValue(0, 100000);
-
-	u32 sandColors[] = {0xf9a31bff, 0xffd541ff, 0xfffc40ff};
-	u32 waterColors[] = {0x143464ff, 0x285cc4ff, 0x249fdeff};
-	u32 gasColors[] = {0xb3b9d1ff, 0xb3b9d1ff};
-	u32 stoneColors[] = {0x333941ff, 0x4a5462ff, 0x6d758dff};
-
-	switch(type)
-	{
-	case PixelType::SAND:
-		result = GetColor(sandColors[randValue % ArrayCount(sandColors)]);
-		break;
-	case PixelType::WATER:	
-		result = GetColor(waterColors[randValue % ArrayCount(waterColors)]);
-		break;
-	case PixelType::GAS:
-		result = GetColor(gasColors[randValue % ArrayCount(gasColors)]);
-		break;
-	case PixelType::STONE:
-		result = GetColor(stoneColors[randValue % ArrayCount(waterColors)]);
-		break;
-	case PixelType::NONE:
-		result = BLACK;
-		break;
-	default:
-		Assert(false); // Type found without a color? Fix this
+	u64 result = rowBits[wordIndex] >> shift;
+	if(wordIndex + 1 < wordCount)
+	{
+		result |= rowBits[wordIndex + 1] << (64 - shift);
 	}
 	return result;
 }
 
+// Bits x - 1 to x + 1 of a row of words, as the low three bits, where bitOffset is the offset of x - 1
+inline u32 GetRowBitsAround(const u64 *rowBits, u32 bitOffset)
+{
+	u32 bitIndex = bitOffset % 64;
+	u64 result = rowBits[bitOffset / 64] >> bitIndex;
+	if(bitIndex > 61)
+	{
+		result |= rowBits[(bitOffset / 64) + 1] << (64 - bitIndex);
+	}
+	return (u32)(result & 7);
+}
 
+#define UPDATE_STAGE_COUNT 4
 
-inline bool AreDirtyRectsEqual(DirtyRect rectA, DirtyRect rectB)
+// A move from a region to a pixel beyond its direct neighbours. A region never updates at the same time as
+// its neighbours, but regions further away may be in flight, so these are held back until every region has
+// updated for the frame. Only happens when the region size is smaller than the distance a pixel can reach
+struct CrossRegionMove
 {
-	bool result = (rectA.minX == rectB.minX) &&
-		(rectA.minY == rectB.minY) &&
-		(rectA.maxX == rectB.maxX) &&
-		(rectA.maxY == rectB.maxY);
-	return result;
+	u32 srcRegionIndex;
+	u32 sequenceNum;
+	CellPos srcPos;
+	CellPos destPos;
+	PixelType srcType;
+	PixelType destType;
+	bool swap;
+};
+
+// Outbound moves from the regions a single worker has updated this frame
+struct alignas(64) CrossRegionMoveQueue
+{
+	CrossRegionMove *moves;
+	u32 count;
+	u32 capacity;
+
+	void Push(CrossRegionMove move)
+	{
+		if(count == capacity)
+		{
+			capacity = MAX(capacity * 2, 64);
+			moves = (CrossRegionMove *)realloc(moves, capacity * sizeof(CrossRegionMove));
+		}
+		move.sequenceNum = count;
+		moves[count++] = move;
+	}
+};
+
+// What changed a region's pixels other than its own update, see UpdateRegionSleep
+enum RegionWakeFlags : u8
+{
+	REGION_WAKE_NEIGHBOUR = 1, // A neighbouring region's update moved pixels across the border
+	REGION_WAKE_EDIT = 2, // Pixels created or erased from outside the update
+};
+
+// The region a worker is currently updating. Bounds are inclusive pixel bounds covering the region
+// and its neighbours, which are safe to write to directly
+struct RegionUpdateContext
+{
+	u32 regionIndex;
+	s32 minX;
+	s32 maxX;
+	s32 minY;
+	s32 maxY;
+	CrossRegionMoveQueue *outboundMoves;
+	DirtyRect *workerDirtyRects;
+	bool narrowRows; // Rows are scanned only around changed cells, see GetRowScanBounds
+};
+
+// Pixels of each material within a region. Kept on its own cache line, as workers
+// updating different regions can be adjusting the counts of neighbouring ones
+struct alignas(64) RegionMaterialCounts
+{
+	std::atomic<u32> counts[MaterialCount];
+};
+
+// The pixels of each material within an occupancy block are counted in a byte, packed eight materials to a word, so
+// a word of a block's counts is read at once and a pixel arriving or leaving is one add. A block holds no more pixels
+// than fit in a byte
+constexpr u32 BlockCountWordCount = (MaterialCount + 7) / 8;
+static_assert(OccupancyBlockSize * OccupancyBlockSize <= 255, "Occupancy block counts have to fit in a byte");
+
+struct BlockMaterialCounts
+{
+	u64 words[BlockCountWordCount];
+};
+
+// Every material that can be counted, which leaves out empty pixels
+constexpr MaterialMask AnyMaterialMask = ~GetMaterialBit(PixelType::NONE);
+
+inline u32 GetBlockCountWord(PixelType type)
+{
+	return type / 8;
 }
 
-inline bool IsInvalidDirtyRect(DirtyRect rect)
+inline u64 GetBlockCountUnit(PixelType type)
 {
-	return AreDirtyRectsEqual(rect, InvalidDirtyRect);
+	return 1ULL << ((type % 8) * 8);
 }
 
-inline bool IsPosInDirtyRect(Vector2 pos, DirtyRect rect)
+// Bytes of a block's counts for the materials in typeMask
+constexpr BlockMaterialCounts GetBlockCountBytes(MaterialMask typeMask)
 {
-	bool result = pos.x >= rect.minX && pos.x < rect.maxX &&
-		pos.y >= rect.minY && pos.y < rect.maxY;
+	BlockMaterialCounts result = {};
+	for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+	{
+		result.words[typeNum / 8] |= HasMaterial(typeMask, typeNum) ? (0xffULL << ((typeNum % 8) * 8)) : 0;
+	}
 	return result;
 }
 
-struct PixelState
+inline MaterialMask GetBlockMaterialMask(const BlockMaterialCounts &blockCounts)
 {
-	u32 lastFrameUpdated;
-	PixelType type;
-};
+	MaterialMask result = {};
+	for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+	{
+		if((blockCounts.words[typeNum / 8] >> ((typeNum % 8) * 8)) & 0xff)
+		{
+			result |= GetMaterialBit(typeNum);
+		}
+	}
+	return result;
+}
 
-#define UPDATE_STAGE_COUNT 4
-struct SimUpdateStage
+// A region waiting to be scheduled, with cost being the pixel area it will scan
+struct RegionTask
 {
-	u32 *regionIndicesToUpdate;
-	u32 regionIndexCount;
+	u32 regionIndex;
+	u32 cost;
+	u32 queueIndex;
 };
 
 class PixelSim
 {
 public:
-	PixelSim(u32 simWidth, u32 simHeight, u32 simPixelScale, u32 regionSize) 
-		: m_simWidth(simWidth), m_simHeight(simHeight), m_simPixelScale(simPixelScale), m_regionPixelSize(regionSize)
+	PixelSim(u32 simWidth, u32 simHeight, u32 simPixelScale, u32 regionSize, u32 threadCount) 
+		: m_simWidth(simWidth), m_simHeight(simHeight), m_simPixelScale(simPixelScale), m_regionPixelSize(regionSize),
+		m_workerPool(threadCount)
 	{
 		m_pixelTotal = m_simWidth * m_simHeight;
 
-		m_pixelStates = (PixelState *)malloc(m_pixelTotal * sizeof(PixelState));
-		memset(m_pixelStates, 0, m_pixelTotal * sizeof(PixelState));
+		m_updateFrameNum = 0;
+		SetRandomSeed(0);
+
+		m_deterministic = false;
+		m_hashVerification = false;
+		m_fullRectScans = false;
+		m_stateHashes = nullptr;
+		m_stateHashCount = 0;
+		m_stateHashCapacity = 0;
+
+		// A region scans one pixel of padding either side, plus one more its dirty rect can spill over
+		Assert((m_regionPixelSize + 4) <= ((MaxRowRandomWords - 1) * 64));
+
+		// Regions of a stage run at the same time and can both reach into the neighbour between them, so have to be wide
+		// enough that they never touch the same pixels
+		AssertMsg(m_regionPixelSize >= (2 * MaxPixelReach), "Regions too small for non-neighbouring regions to stay apart");
+
+		// Planes are stored a region per tile, so a region's own pixels are contiguous and neighbouring
+		// regions never share a cache line. Tiles on the right and bottom edges are padded out to full size,
+		// and a border of tiles surrounds the sim, deeper than any pixel can move in one step
+		AssertMsg(m_regionPixelSize * GhostBorderTiles >= MaxPixelReach, "Ghost border narrower than a pixel can move");
+		m_layout.Init(m_regionPixelSize, m_simWidth, m_simHeight, GhostBorderTiles);
+		m_cellTotal = m_layout.GetCellCount();
+
+		// Pixel state is split into planes, so the update only pulls in the bytes it reads.
+		// Types are what neighbour tests look at, the rest is rendering
+		m_pixelTypeMemory = (u8 *)malloc((m_cellTotal * sizeof(PixelType)) + SimdScanOverread + 63);
+		m_pixelTypes = (PixelType *)Align64((memIdx)m_pixelTypeMemory);
+
+		// Everything outside the sim, the border and edge tile padding, is boundary
+		memset(m_pixelTypes, PixelType::BOUNDARY, (m_cellTotal * sizeof(PixelType)) + SimdScanOverread);
+		for(u32 y = 0; y < m_simHeight; ++y)
+		{
+			for(u32 x = 0; x < m_simWidth; ++x)
+			{
+				GetPlaneCell(m_pixelTypes, m_layout, x, y) = PixelType::NONE;
+			}
+		}
+
+		m_pixelColorVariants = (u8 *)malloc(m_cellTotal * sizeof(u8));
+		memset(m_pixelColorVariants, 0, m_cellTotal * sizeof(u8));
 
+		// Row major for the texture upload. Only read when drawing, rebuilt from the planes of changed regions
 		m_pixelBuffer = (Color *)malloc(m_pixelTotal * sizeof(Color));
 		memset(m_pixelBuffer, 0, m_pixelTotal * sizeof(Color));
 
+		memset(m_variantColors, 0, sizeof(m_variantColors));
+		for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+		{
+			const MaterialDef *material = &gMaterialDefs[typeNum];
+			for(u32 variantNum = 0; variantNum < material->colorCount; ++variantNum)
+			{
+				m_variantColors[(typeNum * MaxColorVariants) + variantNum] = GetColor(material->colors[variantNum]);
+			}
+		}
+
 		m_regionColumns = (u32)ceil((r32)m_simWidth / (r32)m_regionPixelSize);
 		m_regionRows = (u32)ceil((r32)m_simHeight / (r32)m_regionPixelSize);
 
 		m_regionCount = m_regionColumns * m_regionRows;
+		m_regionMaterialCounts = new RegionMaterialCounts[m_regionCount];
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
+		{
+			for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+			{
+				m_regionMaterialCounts[regionIndex].counts[typeNum].store(0);
+			}
+		}
+
+		// Materials are also counted in small blocks, as the level of an occupancy pyramid between regions and pixels.
+		// Queries and the update can then rule out a block without looking at its pixels
+		AssertMsg((m_regionPixelSize & (OccupancyBlockSize - 1)) == 0, "Regions must be a whole number of occupancy blocks");
+		m_blockColumns = m_regionColumns * (m_regionPixelSize >> OccupancyBlockShift);
+		m_blockRows = m_regionRows * (m_regionPixelSize >> OccupancyBlockShift);
+		m_blockMaterialCounts = (BlockMaterialCounts *)malloc(m_blockColumns * m_blockRows * sizeof(BlockMaterialCounts));
+		memset(m_blockMaterialCounts, 0, m_blockColumns * m_blockRows * sizeof(BlockMaterialCounts));
+		m_regionClassMasks = (u8 *)malloc(m_regionCount * sizeof(u8));
+		memset(m_regionClassMasks, 0, m_regionCount * sizeof(u8));
+
+		// Region scans instantiated for every combination of moving classes, in both row directions
+		AddRegionKernels<0>();
+		AddRegionKernels<1>();
+		AddRegionKernels<2>();
+		AddRegionKernels<3>();
+		AddRegionKernels<4>();
+		AddRegionKernels<5>();
+		AddRegionKernels<6>();
+		AddRegionKernels<7>();
+		static_assert(MovingClassMaskCount == 8, "Add region kernels for the new movement class combinations");
+
+		SetBitSlicedPowder(gBitSlicedPowder);
+
+		m_regionColorsDirty = (u8 *)malloc(m_regionCount * sizeof(u8));
+		memset(m_regionColorsDirty, 0, m_regionCount * sizeof(u8));
+
+		m_regionSignatures = (u64 *)malloc(m_regionCount * sizeof(u64));
+		memset(m_regionSignatures, 0, m_regionCount * sizeof(u64));
+		m_regionQuietSteps = (u32 *)malloc(m_regionCount * sizeof(u32));
+		memset(m_regionQuietSteps, 0, m_regionCount * sizeof(u32));
+		m_bandSignatures = (u64 *)malloc(m_regionRows * sizeof(u64));
+		memset(m_bandSignatures, 0, m_regionRows * sizeof(u64));
+		m_bandRegionSignatures = (u64 *)malloc(m_regionColumns * sizeof(u64));
+		m_regionWakeFlags = new std::atomic<u8>[m_regionCount];
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
+		{
+			m_regionWakeFlags[regionIndex].store(0);
+		}
+		m_awakeRegionCount = 0;
+		m_sleepingRegionCount = 0;
+
+		// One bit per pixel marking it as already updated this step, each region's bits starting on their own cache line
+		m_updatedRowWords = (m_regionPixelSize + 63) / 64;
+		m_regionUpdatedStride = Align64(m_regionPixelSize * m_updatedRowWords * sizeof(u64)) / sizeof(u64);
+		m_regionUpdatedMemory = (u8 *)malloc((m_regionCount * m_regionUpdatedStride * sizeof(u64)) + 63);
+		m_regionUpdatedBits = (u64 *)Align64((memIdx)m_regionUpdatedMemory);
+		memset(m_regionUpdatedBits, 0, m_regionCount * m_regionUpdatedStride * sizeof(u64));
+		m_regionUpdatedClearFrames = (u32 *)malloc(m_regionCount * sizeof(u32));
+		memset(m_regionUpdatedClearFrames, 0, m_regionCount * sizeof(u32));
+
+		// Alongside its dirty rect each region keeps a bit for every one of its cells that changed. Rows and columns
+		// start one before the region and end one after, the reach of its dirty rect, though only its own cells are
+		// ever set. Each region's bits start on their own cache line
+		m_changedCellRowCount = m_regionPixelSize + 2;
+		m_changedCellRowWords = (m_changedCellRowCount + 63) / 64;
+		m_regionChangedCellStride = Align64(m_changedCellRowCount * m_changedCellRowWords * sizeof(u64)) / sizeof(u64);
+		Assert(m_changedCellRowWords <= MaxRowRandomWords);
 		for(int i = 0; i < DirtyRectBufferCount; ++i)
 		{
 			m_regionDirtyRectBuffers[i] = (DirtyRect *)malloc(m_regionCount * sizeof(DirtyRect));
-			ClearRegionDirtyRects(m_regionDirtyRectBuffers[i]);
+			ResetDirtyBuffer(m_regionDirtyRectBuffers[i]);
+
+			m_changedCellMemory[i] = (u8 *)malloc((m_regionCount * m_regionChangedCellStride * sizeof(u64)) + 63);
+			m_changedCellBuffers[i] = (u64 *)Align64((memIdx)m_changedCellMemory[i]);
+			memset(m_changedCellBuffers[i], 0, m_regionCount * m_regionChangedCellStride * sizeof(u64));
 		}
+
+		// What regions drop going to sleep is kept the same way, until they wake up
+		m_sleepDirtyRects = (DirtyRect *)malloc(m_regionCount * sizeof(DirtyRect));
+		ResetDirtyBuffer(m_sleepDirtyRects);
+		m_sleepChangedCellMemory = (u8 *)malloc((m_regionCount * m_regionChangedCellStride * sizeof(u64)) + 63);
+		m_sleepChangedCells = (u64 *)Align64((memIdx)m_sleepChangedCellMemory);
+		memset(m_sleepChangedCells, 0, m_regionCount * m_regionChangedCellStride * sizeof(u64));
+
+		m_regionActiveCellUpdates = (u8 *)malloc(m_regionCount * sizeof(u8));
+		memset(m_regionActiveCellUpdates, 0, m_regionCount * sizeof(u8));
+		m_activeCellRegionCount = 0;
 		m_readRegionBufferIndex = 0;
 		m_writeRegionBufferIndex = 1;
 
-		// Split region updates into stages. Each stage will update a set regions in a checkboard pattern
-		// To be used by threading to isolate data access for pixels to each thread
-		u32 *updateOrderBuffer = (u32 *)malloc(m_regionCount * sizeof(u32));
-
-		
-		u32 maxRegionsPerStage = (u32)ceil(m_regionCount / UPDATE_STAGE_COUNT) + 1;
-		
-		memset(m_stages, 0, UPDATE_STAGE_COUNT * sizeof(SimUpdateStage));
-		m_stages[0].regionIndicesToUpdate = updateOrderBuffer + (maxRegionsPerStage * 0);
-		m_stages[1].regionIndicesToUpdate = updateOrderBuffer + (maxRegionsPerStage * 1);
-		m_stages[2].regionIndicesToUpdate = updateOrderBuffer + (maxRegionsPerStage * 2);
-		m_stages[3].regionIndicesToUpdate = updateOrderBuffer + (maxRegionsPerStage * 3);
-		
-		for(s32 rowNum = (m_regionRows-1); rowNum >= 0; --rowNum) // Add from the bottom of the screen up
+		// Split regions into stages in a checkerboard pattern, so no two regions of a stage neighbour each other.
+		// A region only touches pixels of its direct neighbours, so ordering each region after its neighbours
+		// from earlier stages is enough to isolate data access between threads
+		m_regionStageNums = (u8 *)malloc(m_regionCount * sizeof(u8));
+		for(u32 rowNum = 0; rowNum < m_regionRows; ++rowNum)
 		{
-			for(s32 colNum = 0; colNum < m_regionColumns; ++colNum)
+			for(u32 colNum = 0; colNum < m_regionColumns; ++colNum)
 			{
-				SimUpdateStage *stage = nullptr;
-
 				bool colIsEven = ((colNum % 2) == 0);
 				bool rowIsEven = ((rowNum % 2) == 0);
-				
-				if(colIsEven && rowIsEven) { stage = &m_stages[0]; }
-				else if(!colIsEven && rowIsEven)  { stage = &m_stages[1]; }
-				else if(colIsEven && !rowIsEven)  { stage = &m_stages[2]; }
-				else if(!colIsEven && !rowIsEven) { stage = &m_stages[3]; }
 
-				Assert(stage);
-				Assert(stage->regionIndexCount < maxRegionsPerStage);
+				u8 stageNum = 0;
+				if(colIsEven && rowIsEven) { stageNum = 0; }
+				else if(!colIsEven && rowIsEven)  { stageNum = 1; }
+				else if(colIsEven && !rowIsEven)  { stageNum = 2; }
+				else if(!colIsEven && !rowIsEven) { stageNum = 3; }
 
 				u32 regionIndex = (rowNum * m_regionColumns) + colNum;
-				stage->regionIndicesToUpdate[stage->regionIndexCount] = regionIndex;
-				++stage->regionIndexCount;		
+				m_regionStageNums[regionIndex] = stageNum;
 			}
 		}
+		m_regionDependencyCounts = new std::atomic<u32>[m_regionCount];
+
+		// Each worker owns a queue of regions that are ready to update. Any region can end up on any queue
+		u32 workerCount = m_workerPool.GetThreadCount();
+		m_regionQueues = new WorkStealingDeque[workerCount];
+		for(u32 workerNum = 0; workerNum < workerCount; ++workerNum)
+		{
+			m_regionQueues[workerNum].Init(m_regionCount);
+		}
+		m_readyTasks = (RegionTask *)malloc(m_regionCount * sizeof(RegionTask));
+		m_queueCosts = (u64 *)malloc(workerCount * sizeof(u64));
+
+		// Workers mark dirty rects in their own buffer, merged into the write buffer once all regions are done.
+		// Each buffer starts on its own cache line so workers never share one
+		m_workerDirtyRectStride = Align64(m_regionCount * sizeof(DirtyRect));
+		m_workerDirtyRectMemory = (u8 *)malloc((workerCount * m_workerDirtyRectStride) + 63);
+		u8 *alignedWorkerDirtyRects = (u8 *)Align64((memIdx)m_workerDirtyRectMemory);
+		m_workerDirtyRects = (DirtyRect **)malloc(workerCount * sizeof(DirtyRect *));
+		for(u32 workerNum = 0; workerNum < workerCount; ++workerNum)
+		{
+			m_workerDirtyRects[workerNum] = (DirtyRect *)(alignedWorkerDirtyRects + (workerNum * m_workerDirtyRectStride));
+			ResetDirtyBuffer(m_workerDirtyRects[workerNum]);
+		}
+
+		m_outboundMoveQueues = new CrossRegionMoveQueue[workerCount];
+		memset(m_outboundMoveQueues, 0, workerCount * sizeof(CrossRegionMoveQueue));
+		m_sortedMoves = nullptr;
+		m_sortedMoveCapacity = 0;
+
+		// The block engine works from the same dirty rects, but also needs those of the step before
+		m_updateEngine = BlockEngineAvailable ? gDefaultUpdateEngine : UPDATE_ENGINE_SCAN;
+		m_blockMoves = nullptr;
+		if(BlockEngineAvailable)
+		{
+			m_blockMoves = (u8 (*)[BlockStateCount])malloc(2 * BlockStateCount * sizeof(u8));
+			BuildBlockMoveTable(m_blockMoves);
+		}
+		m_prevDirtyRects = (DirtyRect *)malloc(m_regionCount * sizeof(DirtyRect));
+		m_blockUpdateRects = (DirtyRect *)malloc(m_regionCount * sizeof(DirtyRect));
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
+		{
+			m_prevDirtyRects[regionIndex] = InvalidDirtyRect;
+			m_blockUpdateRects[regionIndex] = InvalidDirtyRect;
+		}
 	}
 
-	void ClearRegionDirtyRects(DirtyRect *regionDirtyRects)
+	// Empties a whole buffer, rather than just what its dirty rects cover
+	void ResetDirtyBuffer(DirtyRect *regionDirtyRects)
 	{
 		for(u32 regionNum = 0; regionNum < m_regionCount; ++regionNum)
 		{
-			DirtyRect *regionDirtyRect = &regionDirtyRects[regionNum];
+			regionDirtyRects[regionNum] = InvalidDirtyRect;
+		}
+	}
+
+	// Changed cells are only ever set within their region's dirty rect, so only those rows need emptying
+	void ClearRegionDirtyRect(DirtyRect *regionDirtyRects, u64 *changedCells, u32 regionIndex)
+	{
+		DirtyRect *regionDirtyRect = &regionDirtyRects[regionIndex];
+		if(!IsInvalidDirtyRect(*regionDirtyRect))
+		{
+			s32 firstRowY = GetRegionFirstCellY(regionIndex);
+			u64 *firstRowCells = GetRegionChangedCells(changedCells, regionIndex) + ((regionDirtyRect->minY - firstRowY) * m_changedCellRowWords);
+			u32 rowCount = (u32)(regionDirtyRect->maxY - regionDirtyRect->minY + 1);
+			memset(firstRowCells, 0, rowCount * m_changedCellRowWords * sizeof(u64));
 			*regionDirtyRect = InvalidDirtyRect;
 		}
 	}
 
+	// Adds a region's dirty rect and changed cells to those of another buffer, leaving the first empty
+	void MoveRegionDirtyRect(DirtyRect *srcDirtyRects, u64 *srcChangedCells, DirtyRect *destDirtyRects, u64 *destChangedCells, u32 regionIndex)
+	{
+		DirtyRect srcRect = srcDirtyRects[regionIndex];
+		if(IsInvalidDirtyRect(srcRect))
+		{
+			return;
+		}
+
+		ExpandDirtyRect(&destDirtyRects[regionIndex], srcRect.minX, srcRect.maxX, srcRect.minY, srcRect.maxY);
+		u32 firstWord = (u32)(srcRect.minY - GetRegionFirstCellY(regionIndex)) * m_changedCellRowWords;
+		u32 wordCount = (u32)(srcRect.maxY - srcRect.minY + 1) * m_changedCellRowWords;
+		u64 *srcCells = GetRegionChangedCells(srcChangedCells, regionIndex) + firstWord;
+		u64 *destCells = GetRegionChangedCells(destChangedCells, regionIndex) + firstWord;
+		for(u32 wordIndex = 0; wordIndex < wordCount; ++wordIndex)
+		{
+			destCells[wordIndex] |= srcCells[wordIndex];
+		}
+		ClearRegionDirtyRect(srcDirtyRects, srcChangedCells, regionIndex);
+	}
+
+	void ClearRegionDirtyRects(DirtyRect *regionDirtyRects, u64 *changedCells)
+	{
+		for(u32 regionNum = 0; regionNum < m_regionCount; ++regionNum)
+		{
+			ClearRegionDirtyRect(regionDirtyRects, changedCells, regionNum);
+		}
+	}
+
 	void SwapRegionDirtyRectBuffers()
 	{
 		u8 prevReadIndex = m_readRegionBufferIndex;
@@ -222,16 +582,96 @@ public:
 		m_writeRegionBufferIndex = prevReadIndex;
 
 		// Prep write buffer by clearing
-		ClearRegionDirtyRects(m_regionDirtyRectBuffers[m_writeRegionBufferIndex]);
+		ClearRegionDirtyRects(m_regionDirtyRectBuffers[m_writeRegionBufferIndex], m_changedCellBuffers[m_writeRegionBufferIndex]);
+	}
+
+	// Row of a region's first row of changed cells, the row above the region
+	inline s32 GetRegionFirstCellY(u32 regionIndex)
+	{
+		s32 result = (s32)((regionIndex / m_regionColumns) * m_regionPixelSize) - 1;
+		return result;
+	}
+
+	inline u64 *GetRegionChangedCells(u64 *changedCells, u32 regionIndex)
+	{
+		return changedCells + (regionIndex * m_regionChangedCellStride);
+	}
+
+	// Column of the first bit in each of a region's changed cell rows, the column left of the region
+	inline s32 GetRegionFirstCellX(u32 regionIndex)
+	{
+		s32 result = (s32)((regionIndex % m_regionColumns) * m_regionPixelSize) - 1;
+		return result;
+	}
+
+	// Marks a pixel as changed for its region's next update. Like the updated bits, regions other than the one
+	// updating can be marked by two workers at once, so their words are set atomically
+	inline void MarkCellChanged(u32 regionIndex, s32 x, s32 y, RegionUpdateContext *context)
+	{
+		Assert(regionIndex == GetRegionIndex(x, y));
+		u32 bitNum = (x & m_layout.tileMask) + 1;
+		u32 rowNum = (y & m_layout.tileMask) + 1;
+
+		u64 *word = GetRegionChangedCells(m_changedCellBuffers[m_writeRegionBufferIndex], regionIndex) +
+			(rowNum * m_changedCellRowWords) + (bitNum / 64);
+		u64 bit = 1ULL << (bitNum % 64);
+		if(context && context->regionIndex != regionIndex)
+		{
+			AtomicOr64(word, bit);
+		}
+		else
+		{
+			*word |= bit;
+		}
+	}
+
+	// Marks the pixels set in a row of bits laid out from word firstWord, moved across by xOffset, as changed on row y.
+	// For the region being updated marking a row of its own pixels at once
+	void MarkRowCellsChanged(u32 regionIndex, s32 y, s32 firstWord, u32 wordCount, const u64 *rowBits, s32 xOffset)
+	{
+		u64 *rowCells = GetRegionChangedCells(m_changedCellBuffers[m_writeRegionBufferIndex], regionIndex) +
+			(((y & m_layout.tileMask) + 1) * m_changedCellRowWords);
+		s32 firstCellX = GetRegionFirstCellX(regionIndex);
+		for(u32 wordIndex = 0; wordIndex < wordCount; ++wordIndex)
+		{
+			u64 bits = rowBits[wordIndex];
+			if(!bits)
+			{
+				continue;
+			}
+
+			// Pixels left of the region's first cell are never set, so can be shifted out
+			s32 bitOffset = ((firstWord + (s32)wordIndex) * 64) + xOffset - firstCellX;
+			if(bitOffset < 0)
+			{
+				bits >>= -bitOffset;
+				bitOffset = 0;
+			}
+
+			u32 bitIndex = (u32)bitOffset % 64;
+			u32 cellWord = (u32)bitOffset / 64;
+			rowCells[cellWord] |= bits << bitIndex;
+			if(bitIndex > 0 && (bits >> (64 - bitIndex)))
+			{
+				rowCells[cellWord + 1] |= bits >> (64 - bitIndex);
+			}
+		}
+	}
+
+	inline bool InSimBounds(s32 x, s32 y)
+	{
+		// Negative coordinates wrap around to large unsigned values
+		bool result = ((u32)x < m_simWidth) && ((u32)y < m_simHeight);
+		return result;
 	}
 
-	bool InSimBounds(u32 x, u32 y)
+	// Inside the sim or its ghost border, so backed by the planes
+	inline bool InPlaneBounds(s32 x, s32 y)
 	{
-		bool result = (x >= 0 && x < m_simWidth) &&
-			(y >= 0 && y < m_simHeight);
+		bool result = ((u32)(x + m_layout.borderSize) < (m_simWidth + (2 * m_layout.borderSize))) &&
+			((u32)(y + m_layout.borderSize) < (m_simHeight + (2 * m_layout.borderSize)));
 		return result;
 	}
-	bool InSimBounds(Vector2 pos) { return InSimBounds(pos.x, pos.y); }
 
 
 	inline Vector2 ScreenToSimPos(Vector2 screenPos)
@@ -250,415 +690,2584 @@ public:
 		return result;
 	}
 
-	void AddToDirtyRect(Vector2 pos)
+	inline void ExpandDirtyRect(DirtyRect *dirtyRect, s32 minX, s32 maxX, s32 minY, s32 maxY)
+	{
+		// If dirty rect has not be initialised, set default values so min/max calculations work
+		// min become highests possible values, so width and height of sim
+		// max set to zero
+		if(IsInvalidDirtyRect(*dirtyRect))
+		{
+			dirtyRect->minX = m_simWidth;
+			dirtyRect->maxX = 0;
+			dirtyRect->minY = m_simHeight;
+			dirtyRect->maxY = 0;
+		}
+
+		dirtyRect->minX = MIN(dirtyRect->minX, minX);
+		dirtyRect->maxX = MAX(dirtyRect->maxX, maxX);
+		dirtyRect->minY = MIN(dirtyRect->minY, minY);
+		dirtyRect->maxY = MAX(dirtyRect->maxY, maxY);
+	}
+
+	// Pixels changed by a region update are marked in the worker's own buffer, anything else goes straight into
+	// the write buffer, which is only safe while no workers are running
+	void AddToDirtyRect(s32 x, s32 y, RegionUpdateContext *context = nullptr)
 	{
-		u32 regionColumn = floorf(pos.x / m_regionPixelSize);
-		u32 regionRow = floorf(pos.y / m_regionPixelSize);
-		u32 regionIndex = (regionRow * m_regionColumns) + regionColumn;
+		u32 regionIndex = GetRegionIndex(x, y);
 
 		Assert(regionIndex < m_regionCount);
-		DirtyRect *regionDirtyRects = m_regionDirtyRectBuffers[m_writeRegionBufferIndex];
+		DirtyRect *regionDirtyRects = context ? context->workerDirtyRects : m_regionDirtyRectBuffers[m_writeRegionBufferIndex];
 		DirtyRect *regionDirtyRect = &regionDirtyRects[regionIndex];
 
-		// If dirty rect has not be initialised, set default values so min/max calculations work
-		// min become highests possible values, so width and height of sim
-		// max set to zero
-		if(IsInvalidDirtyRect(*regionDirtyRect))
+		ExpandDirtyRect(regionDirtyRect, x - 1, x + 1, y - 1, y + 1);
+		if(gChangedCellCost > 0)
+		{
+			MarkCellChanged(regionIndex, x, y, context);
+		}
+
+		if(!context)
 		{
-			regionDirtyRect->minX = m_simWidth;
-			regionDirtyRect->maxX = 0.0f;
-			regionDirtyRect->minY = m_simHeight;
-			regionDirtyRect->maxY = 0.0f;
+			m_regionColorsDirty[regionIndex] = 1;
 		}
 
-		regionDirtyRect->minX = MIN(regionDirtyRect->minX, pos.x - 1);
-		regionDirtyRect->maxX = MAX(regionDirtyRect->maxX, pos.x + 1);
-		regionDirtyRect->minY = MIN(regionDirtyRect->minY, pos.y - 1);
-		regionDirtyRect->maxY = MAX(regionDirtyRect->maxY, pos.y + 1);
+		// Changes from anywhere but the region's own update wake it up if it is asleep
+		if(gRegionSleepSteps > 0 && (!context || context->regionIndex != regionIndex))
+		{
+			u8 wakeFlag = context ? REGION_WAKE_NEIGHBOUR : REGION_WAKE_EDIT;
+			m_regionWakeFlags[regionIndex].fetch_or(wakeFlag, std::memory_order_relaxed);
+		}
 	}
 
-	inline Rectangle GetSimSize()
+	struct MergeDirtyRectsJob
 	{
-		Rectangle simRectangle = {0,0, (r32)m_simWidth, (r32)m_simHeight};
-		return simRectangle;
+		PixelSim *sim;
+	};
+
+	// Each worker reduces a contiguous range of regions across every worker buffer into the write buffer,
+	// resetting the worker buffers as it goes. No two workers touch the same region, so no locking is needed
+	static void MergeWorkerDirtyRectsJob(void *userData, u32 workerIndex)
+	{
+		MergeDirtyRectsJob *job = (MergeDirtyRectsJob *)userData;
+		PixelSim *sim = job->sim;
+
+		u32 workerCount = sim->m_workerPool.GetThreadCount();
+		u32 firstRegion = (sim->m_regionCount * workerIndex) / workerCount;
+		u32 endRegion = (sim->m_regionCount * (workerIndex + 1)) / workerCount;
+
+		DirtyRect *writeDirtyRects = sim->m_regionDirtyRectBuffers[sim->m_writeRegionBufferIndex];
+		for(u32 regionIndex = firstRegion; regionIndex < endRegion; ++regionIndex)
+		{
+			DirtyRect *mergedRect = &writeDirtyRects[regionIndex];
+			for(u32 workerNum = 0; workerNum < workerCount; ++workerNum)
+			{
+				DirtyRect *workerRect = &sim->m_workerDirtyRects[workerNum][regionIndex];
+				if(!IsInvalidDirtyRect(*workerRect))
+				{
+					sim->ExpandDirtyRect(mergedRect, workerRect->minX, workerRect->maxX, workerRect->minY, workerRect->maxY);
+					*workerRect = InvalidDirtyRect;
+				}
+			}
+		}
 	}
 
-	inline u32 GetSimScale()
+	// Inclusive pixel bounds of a region, clipped to the sim
+	inline void GetRegionBounds(u32 regionIndex, s32 *minX, s32 *maxX, s32 *minY, s32 *maxY)
 	{
-		return m_simPixelScale;
+		s32 colNum = regionIndex % m_regionColumns;
+		s32 rowNum = regionIndex / m_regionColumns;
+		*minX = colNum * m_regionPixelSize;
+		*maxX = MIN(*minX + (s32)m_regionPixelSize, (s32)m_simWidth) - 1;
+		*minY = rowNum * m_regionPixelSize;
+		*maxY = MIN(*minY + (s32)m_regionPixelSize, (s32)m_simHeight) - 1;
 	}
 
-	inline Color *GetPixelBuffer()
+	void SetRandomSeed(u64 seed)
 	{
-		return m_pixelBuffer;
+		m_randomSeed = seed;
+		UpdateRandomFrameKeys();
+	}
+
+	void UpdateRandomFrameKeys()
+	{
+		for(u32 streamNum = 0; streamNum < RANDOM_STREAM_COUNT; ++streamNum)
+		{
+			m_randomFrameKeys[streamNum] = GetRandomFrameKey(m_randomSeed, streamNum, m_updateFrameNum);
+		}
+	}
+
+	// Random value for a pixel this frame. Asking again for the same pixel in the same frame gives the same value
+	inline u64 GetRandomU64(u32 x, u32 y, RandomStream stream)
+	{
+		u64 result = GetRandomBits(m_randomFrameKeys[stream], x, y);
+		return result;
 	}
 
-	inline PixelState *GetPixelStatePtr(u32 x, u32 y)
+	// One random bit per pixel, packed 64 pixels to a word. Pixel x of row y uses bit (x % 64) of word (x / 64)
+	inline u64 GetRowRandomWord(u32 wordIndex, u32 y)
 	{
-		Assert(InSimBounds(x, y));
-		u32 offset = (y * m_simWidth) + x;
-		PixelState *outState = m_pixelStates + offset;
-		return outState;
+		u64 result = GetRandomBits(m_randomFrameKeys[RANDOM_STREAM_DIRECTION], wordIndex, y);
+		return result;
 	}
-	inline PixelState *GetPixelStatePtr(Vector2 pos) { return GetPixelStatePtr(pos.x, pos.y); }
 
+	inline bool GetRandomBit(u32 x, u32 y)
+	{
+		bool result = (GetRowRandomWord(x / 64, y) >> (x % 64)) & 1;
+		return result;
+	}
 
-	inline Color GetPixel(u32 x, u32 y)
+	// Bulk version of GetRandomBit for the pixels [startX, endX) of a row, one hash per 64 pixels.
+	// outBits[0] holds the word containing startX
+	void FillRowRandomBits(u32 y, u32 startX, u32 endX, u64 *outBits)
 	{
-		Assert(InSimBounds(x, y));
-		u32 offset = (y * m_simWidth) + x;
-		Color *outPixel = m_pixelBuffer + offset;
-		return *outPixel;
+		u32 firstWord = startX / 64;
+		u32 endWord = ((endX - 1) / 64) + 1;
+		Assert(endWord - firstWord <= MaxRowRandomWords);
+		for(u32 wordIndex = firstWord; wordIndex < endWord; ++wordIndex)
+		{
+			outBits[wordIndex - firstWord] = GetRowRandomWord(wordIndex, y);
+		}
 	}
-	inline Color GetPixel(Vector2 pos) { return GetPixel(pos.x, pos.y); }
 
-	inline void SetPixel(u32 x, u32 y, Color color)
-	{
-		Assert(InSimBounds(x, y));
-		u32 offset = (y * m_simWidth) + x;
-		Color *outPixel = m_pixelBuffer + offset;
-		*outPixel = color;
-	}
-	inline void SetPixel(Vector2 pos, Color color) { return SetPixel(pos.x, pos.y, color); }
+	inline Rectangle GetSimSize()
+	{
+		Rectangle simRectangle = {0,0, (r32)m_simWidth, (r32)m_simHeight};
+		return simRectangle;
+	}
+
+	inline u32 GetSimScale()
+	{
+		return m_simPixelScale;
+	}
+
+	// Expands the color variants of every region changed since the last call into the row major pixel buffer
+	Color *UpdatePixelBuffer()
+	{
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
+		{
+			if(!m_regionColorsDirty[regionIndex])
+			{
+				continue;
+			}
+			m_regionColorsDirty[regionIndex] = 0;
+
+			s32 minX, maxX, minY, maxY;
+			GetRegionBounds(regionIndex, &minX, &maxX, &minY, &maxY);
+			if(gTileMortonOrder)
+			{
+				CopyTiledToLinear(m_layout, m_pixelBuffer, m_simWidth, minX, maxX, minY, maxY, [this](u32 index) {
+					return m_variantColors[(m_pixelTypes[index] * MaxColorVariants) + m_pixelColorVariants[index]];
+				});
+			}
+			else
+			{
+				// Each row of a region is contiguous in its tile
+				for(s32 y = minY; y <= maxY; ++y)
+				{
+					u32 offset = GetPixelOffset(minX, y);
+					ExpandColors((const u8 *)&m_pixelTypes[offset], &m_pixelColorVariants[offset], (maxX - minX) + 1,
+						(const u32 *)m_variantColors, (u32 *)&m_pixelBuffer[(y * m_simWidth) + minX]);
+				}
+			}
+		}
+		return m_pixelBuffer;
+	}
+
+	inline u32 GetPixelOffset(s32 x, s32 y)
+	{
+		AssertPixelAccess(InPlaneBounds(x, y));
+		u32 offset = m_layout.GetIndex(x, y);
+		return offset;
+	}
+
+	inline CellPos GetCellPos(s32 x, s32 y)
+	{
+		CellPos result = {x, y, GetPixelOffset(x, y)};
+		return result;
+	}
+
+	// Pixel at an offset from pos, which may be in the ghost border. Stays on the precomputed delta while
+	// both are in the same tile, otherwise the index is worked out from scratch
+	inline CellPos GetNeighbourCell(CellPos pos, s32 xOffset, s32 yOffset)
+	{
+		CellPos result = {pos.x + xOffset, pos.y + yOffset, 0};
+		AssertPixelAccess(InPlaneBounds(result.x, result.y));
+
+		u32 localX = (u32)((pos.x & m_layout.tileMask) + xOffset);
+		u32 localY = (u32)((pos.y & m_layout.tileMask) + yOffset);
+		if(!gTileMortonOrder && localX <= m_layout.tileMask && localY <= m_layout.tileMask)
+		{
+			result.index = pos.index + m_layout.GetIndexDelta(xOffset, yOffset);
+		}
+		else
+		{
+			result.index = m_layout.GetIndex(result.x, result.y);
+		}
+		return result;
+	}
+
+	inline u32 GetRegionIndex(s32 x, s32 y)
+	{
+		u32 regionIndex = ((y >> m_layout.tileShift) * m_regionColumns) + (x >> m_layout.tileShift);
+		return regionIndex;
+	}
+
+	// Word and bit holding the updated flag of a pixel
+	inline u64 *GetUpdatedBitWord(s32 x, s32 y, u32 *outRegionIndex, u32 *outBitIndex)
+	{
+		u32 regionIndex = GetRegionIndex(x, y);
+		u32 localX = x & m_layout.tileMask;
+		u32 localY = y & m_layout.tileMask;
+
+		*outRegionIndex = regionIndex;
+		*outBitIndex = localX % 64;
+		u64 *word = m_regionUpdatedBits + (regionIndex * m_regionUpdatedStride) + (localY * m_updatedRowWords) + (localX / 64);
+		return word;
+	}
+
+	// Stop the scan from updating a pixel again this step after it has moved. A neighbouring region's row can share
+	// a word with another region running at the same time, so bits outside the updating region are set atomically
+	inline void MarkPixelUpdated(CellPos pos, RegionUpdateContext *context)
+	{
+		u32 regionIndex, bitIndex;
+		u64 *word = GetUpdatedBitWord(pos.x, pos.y, &regionIndex, &bitIndex);
+		u64 bit = 1ULL << bitIndex;
+		if(context && context->regionIndex != regionIndex)
+		{
+			AtomicOr64(word, bit);
+		}
+		else
+		{
+			*word |= bit;
+		}
+	}
+
+	inline bool IsPixelUpdated(s32 x, s32 y)
+	{
+		u32 regionIndex, bitIndex;
+		u64 word = AtomicLoad64(GetUpdatedBitWord(x, y, &regionIndex, &bitIndex));
+		bool result = (word >> bitIndex) & 1;
+		return result;
+	}
+
+	// Updated bits of count pixels (up to 64) from x along a row, which must all be in the same region
+	inline u64 GetUpdatedBits(s32 x, s32 y, u32 count)
+	{
+		u32 regionIndex, bitIndex;
+		u64 *word = GetUpdatedBitWord(x, y, &regionIndex, &bitIndex);
+
+		u64 result = AtomicLoad64(word) >> bitIndex;
+		if(bitIndex + count > 64)
+		{
+			result |= AtomicLoad64(word + 1) << (64 - bitIndex);
+		}
+		if(count < 64)
+		{
+			result &= (1ULL << count) - 1;
+		}
+		return result;
+	}
+
+	// Reset the updated bits of a region, at most once a step
+	inline void ClearRegionUpdatedBits(u32 regionIndex)
+	{
+		if(m_regionUpdatedClearFrames[regionIndex] != m_updateFrameNum)
+		{
+			m_regionUpdatedClearFrames[regionIndex] = m_updateFrameNum;
+			memset(m_regionUpdatedBits + (regionIndex * m_regionUpdatedStride), 0, m_regionUpdatedStride * sizeof(u64));
+		}
+	}
+
+	inline PixelType GetPixelType(CellPos pos)
+	{
+		return m_pixelTypes[pos.index];
+	}
+
+	inline PixelType GetPixelType(s32 x, s32 y)
+	{
+		AssertPixelAccess(InPlaneBounds(x, y));
+		return GetPlaneCell(m_pixelTypes, m_layout, x, y);
+	}
+
+	inline Color GetPixel(s32 x, s32 y)
+	{
+		u32 offset = GetPixelOffset(x, y);
+		Color result = m_variantColors[(m_pixelTypes[offset] * MaxColorVariants) + m_pixelColorVariants[offset]];
+		return result;
+	}
+	inline Color GetPixel(Vector2 pos) { return GetPixel(pos.x, pos.y); }
+
+	void CreatePixel(s32 x, s32 y, PixelType type)
+	{
+		if(!InSimBounds(x, y))
+		{
+			return;
+		}
+
+		CellPos pos = GetCellPos(x, y);
+		if(m_pixelTypes[pos.index] == PixelType::NONE)
+		{
+			OnPixelTypeChanged(pos, PixelType::NONE, type, nullptr);
+			m_pixelTypes[pos.index] = type;
+			m_pixelColorVariants[pos.index] = GetTypeColorVariant(type, (u32)GetRandomU64(x, y, RANDOM_STREAM_COLOR));
+
+			AddToDirtyRect(x, y);
+		}
+		else if(type == PixelType::NONE) // If we are trying to create empty pixels. aka erase functionality
+		{
+			ClearPixel(pos);
+		}
+	}
+	inline void CreatePixel(Vector2 pos, PixelType type) { CreatePixel((s32)pos.x, (s32)pos.y, type); }
+
+	void CreatePixelsInSquare(Vector2 pos, u32 spawnCount, PixelType type)
+	{
+		s32 halfSideLength = spawnCount / 2;
+		s32 centerX = (s32)pos.x;
+		s32 centerY = (s32)pos.y;
+
+		u32 pixelCount = spawnCount;
+		for(int pixelNum = 0; pixelNum < pixelCount; ++pixelNum)
+		{
+			int randX = GetRandomValue(-halfSideLength, halfSideLength);
+			int randY = GetRandomValue(-halfSideLength, halfSideLength);
+			CreatePixel(centerX + randX, centerY + randY, type);
+		}
+	}
+
+	void CreatePixelsInCircle(Vector2 pos, s32 radius, PixelType type)
+	{
+		s32 centerX = (s32)pos.x;
+		s32 centerY = (s32)pos.y;
+		for(s32 y = -radius; y <= radius; y++)
+		{
+			for(s32 x = -radius; x <= radius; x++)
+			{
+				if((x * x) + (y * y) <= (radius * radius))
+				{
+					CreatePixel(centerX + x, centerY + y, type);
+				}
+			}
+		}
+	}
+
+	// For cases like gas when it leaves the area and we want it to disappear
+	void ClearPixel(CellPos srcPos, RegionUpdateContext *context = nullptr)
+	{
+		OnPixelTypeChanged(srcPos, m_pixelTypes[srcPos.index], PixelType::NONE, context);
+		m_pixelTypes[srcPos.index] = PixelType::NONE;
+		m_pixelColorVariants[srcPos.index] = 0;
+		AddToDirtyRect(srcPos.x, srcPos.y, context);
+	}
+
+	inline bool IsInRegionNeighbourhood(RegionUpdateContext *context, CellPos pos)
+	{
+		bool result = pos.x >= context->minX && pos.x <= context->maxX &&
+			pos.y >= context->minY && pos.y <= context->maxY;
+		return result;
+	}
+
+	// Moves beyond the neighbours of the region being updated are queued and applied once all regions are done
+	void QueueCrossRegionMove(RegionUpdateContext *context, CellPos srcPos, CellPos destPos, bool swap)
+	{
+		CrossRegionMove move = {};
+		move.srcRegionIndex = context->regionIndex;
+		move.srcPos = srcPos;
+		move.destPos = destPos;
+		move.srcType = GetPixelType(srcPos);
+		move.destType = GetPixelType(destPos);
+		move.swap = swap;
+		context->outboundMoves->Push(move);
+	}
+
+	void MovePixel(CellPos srcPos, CellPos destPos, RegionUpdateContext *context = nullptr)
+	{
+		if(context && !IsInRegionNeighbourhood(context, destPos))
+		{
+			QueueCrossRegionMove(context, srcPos, destPos, false);
+			return;
+		}
+
+		u32 srcOffset = srcPos.index;
+		u32 destOffset = destPos.index;
+
+		PixelType srcType = m_pixelTypes[srcOffset];
+		OnPixelTypeChanged(destPos, m_pixelTypes[destOffset], srcType, context);
+		OnPixelTypeChanged(srcPos, srcType, PixelType::NONE, context);
+
+		MarkPixelUpdated(destPos, context);
+		m_pixelTypes[destOffset] = srcType;
+		m_pixelColorVariants[destOffset] = m_pixelColorVariants[srcOffset];
+
+		m_pixelTypes[srcOffset] = PixelType::NONE;
+		m_pixelColorVariants[srcOffset] = 0;
+
+		AddToDirtyRect(srcPos.x, srcPos.y, context);
+		AddToDirtyRect(destPos.x, destPos.y, context);
+	}
+
+	void SwapPixels(CellPos srcPos, CellPos destPos, RegionUpdateContext *context = nullptr)
+	{
+		if(context && !IsInRegionNeighbourhood(context, destPos))
+		{
+			QueueCrossRegionMove(context, srcPos, destPos, true);
+			return;
+		}
+
+		u32 srcOffset = srcPos.index;
+		u32 destOffset = destPos.index;
+
+		PixelType destType = m_pixelTypes[destOffset];
+		u8 destColorVariant = m_pixelColorVariants[destOffset];
+
+		// Material counts only change when the pixels are in different blocks, which is always the case across regions
+		if(GetOccupancyBlockIndex(srcPos.x, srcPos.y) != GetOccupancyBlockIndex(destPos.x, destPos.y))
+		{
+			OnPixelTypeChanged(destPos, destType, m_pixelTypes[srcOffset], context);
+			OnPixelTypeChanged(srcPos, m_pixelTypes[srcOffset], destType, context);
+		}
+
+		MarkPixelUpdated(destPos, context);
+		m_pixelTypes[destOffset] = m_pixelTypes[srcOffset];
+		m_pixelColorVariants[destOffset] = m_pixelColorVariants[srcOffset];
+
+		MarkPixelUpdated(srcPos, context);
+		m_pixelTypes[srcOffset] = destType;
+		m_pixelColorVariants[srcOffset] = destColorVariant;
+
+		AddToDirtyRect(srcPos.x, srcPos.y, context);
+		AddToDirtyRect(destPos.x, destPos.y, context);
+	}
+
+	struct MoveTestResult
+	{
+		CellPos destPos;
+		Interaction interaction; // What happens with the pixel at destPos
+	};
+
+	// Steps from srcPos towards the destination, passing through anything the mover can take the place of.
+	// Stops when blocked, or on the first pixel it swaps with or sinks into. The ghost border is wider than
+	// any velocity, so every step stays inside the planes unchecked
+	bool PhysicsMoveTest(CellPos srcPos, PixelType mover, s32 destX, s32 destY, MoveTestResult *testResult)
+	{
+		const Interaction *interactions = gMaterialLookup.interactions[mover];
+
+		s32 moveX = destX - srcPos.x;
+		s32 moveY = destY - srcPos.y;
+
+		s32 stepX = moveX < 0 ? -1 : 1;
+		s32 stepY = moveY < 0 ? -1 : 1;
+
+		s32 xLeft = abs(moveX);
+		s32 yLeft = abs(moveY);
+
+		CellPos testPos = srcPos;
+
+		testResult->destPos = srcPos;
+		testResult->interaction = INTERACTION_BLOCK;
+
+		while(testPos.x != destX || testPos.y != destY)
+		{
+			s32 xOffset = 0;
+			s32 yOffset = 0;
+			if(xLeft >= yLeft)
+			{
+				xLeft -= 1;
+				xOffset = stepX;
+			}
+			else
+			{
+				yLeft -= 1;
+				yOffset = stepY;
+			}
+			testPos = GetNeighbourCell(testPos, xOffset, yOffset);
+
+			Interaction interaction = interactions[GetPixelType(testPos)];
+			if(interaction == INTERACTION_BLOCK)
+			{
+				break;
+			}
+			testResult->destPos = testPos;
+			testResult->interaction = interaction;
+			if(interaction != INTERACTION_MOVE)
+			{
+				break;
+			}
+		}
+
+		bool canMove = (testResult->interaction != INTERACTION_BLOCK);
+		return canMove;
+	}
+
+	// PhysicsMoveTest along a straight or 45 degree line, length pixels in the pattern direction with x mirrored by xSign.
+	// The direction is known at compile time, so within a row major tile every step is a fixed index offset from the
+	// last and the DDA's bookkeeping drops out. The DDA walks a diagonal as a staircase, x first, so steps alternate here too
+	template<s32 PatternX, s32 PatternY>
+	inline bool PhysicsMoveTestLine(CellPos srcPos, PixelType mover, s32 xSign, s32 length, MoveTestResult *testResult)
+	{
+		constexpr bool Diagonal = (PatternX != 0) && (PatternY != 0);
+		s32 stepX = PatternX * xSign;
+		s32 destX = srcPos.x + (stepX * length);
+		s32 destY = srcPos.y + (PatternY * length);
+
+		bool sameTile = (((srcPos.x ^ destX) | (srcPos.y ^ destY)) & ~(s32)m_layout.tileMask) == 0;
+		if(gTileMortonOrder || !sameTile)
+		{
+			return PhysicsMoveTest(srcPos, mover, destX, destY, testResult);
+		}
+
+		const Interaction *interactions = gMaterialLookup.interactions[mover];
+		u32 stepCount = Diagonal ? (u32)(2 * length) : (u32)length;
+
+		s32 rowDelta = m_layout.GetIndexDelta(0, PatternY);
+		s32 firstDelta = (PatternX != 0) ? stepX : rowDelta;
+		s32 secondDelta = Diagonal ? rowDelta : firstDelta;
+
+		u32 moveCount = 0;
+		u32 stopIndex = srcPos.index + firstDelta;
+		while(moveCount < stepCount && interactions[m_pixelTypes[stopIndex]] == INTERACTION_MOVE)
+		{
+			++moveCount;
+			stopIndex += (moveCount & 1) ? secondDelta : firstDelta;
+		}
+
+		// Same result as the DDA: the last pixel passed through, or the first swapped with or sunk into
+		Interaction interaction = (moveCount < stepCount) ? interactions[m_pixelTypes[stopIndex]] : INTERACTION_MOVE;
+		u32 destStep = moveCount;
+		if(interaction == INTERACTION_MOVE || interaction == INTERACTION_BLOCK)
+		{
+			if(moveCount == 0)
+			{
+				testResult->destPos = srcPos;
+				testResult->interaction = INTERACTION_BLOCK;
+				return false;
+			}
+			destStep = moveCount - 1;
+			interaction = INTERACTION_MOVE;
+		}
+
+		s32 xOffset = (Diagonal ? (s32)((destStep / 2) + 1) : (s32)(destStep + 1)) * stepX;
+		s32 yOffset = (Diagonal ? (s32)((destStep + 1) / 2) : (s32)(destStep + 1)) * PatternY;
+		testResult->destPos = {srcPos.x + xOffset, srcPos.y + yOffset, srcPos.index + m_layout.GetIndexDelta(xOffset, yOffset)};
+		testResult->interaction = interaction;
+		return true;
+	}
+
+	// Tests only the destination pixel, for moves that jump straight there
+	bool PhysicsMoveProbe(CellPos srcPos, PixelType mover, s32 xOffset, s32 yOffset, MoveTestResult *testResult)
+	{
+		testResult->destPos = GetNeighbourCell(srcPos, xOffset, yOffset);
+		testResult->interaction = gMaterialLookup.interactions[mover][GetPixelType(testResult->destPos)];
+
+		bool canMove = (testResult->interaction != INTERACTION_BLOCK);
+		return canMove;
+	}
+
+	// One move of a movement pattern, so its direction is known at compile time. Returns true if the pixel went anywhere
+	template<MovementClass Movement, u32 MoveNum>
+	inline bool TryPatternMove(CellPos pos, PixelType type, RegionUpdateContext *context, s32 xSign, s32 velocity, CellPos *outDestPos)
+	{
+		constexpr MovementPattern pattern = gMovementPatterns[Movement];
+		if(MoveNum >= pattern.moveCount)
+		{
+			return false;
+		}
+		constexpr s32 PatternX = pattern.moves[MoveNum][0];
+		constexpr s32 PatternY = pattern.moves[MoveNum][1];
+
+		MoveTestResult moveResult;
+		bool canMove = pattern.tracePath ?
+			PhysicsMoveTestLine<PatternX, PatternY>(pos, type, xSign, velocity, &moveResult) :
+			PhysicsMoveProbe(pos, type, PatternX * xSign * velocity, PatternY * velocity, &moveResult);
+		if(canMove)
+		{
+			switch(moveResult.interaction)
+			{
+			case INTERACTION_MOVE: { MovePixel(pos, moveResult.destPos, context); } break;
+			case INTERACTION_SWAP: { SwapPixels(pos, moveResult.destPos, context); } break;
+			case INTERACTION_SINK: { ClearPixel(pos, context); } break;
+			default: Assert(false);
+			}
+			if(outDestPos)
+			{
+				*outDestPos = moveResult.destPos;
+			}
+		}
+		return canMove;
+	}
+
+	// Kernel for every moving material of a movement class. Tries each direction of the class in turn,
+	// mirrored by the random bit, and acts on the first one that gets anywhere
+	template<MovementClass Movement>
+	bool UpdateMovingPixel(CellPos pos, PixelType type, RegionUpdateContext *context, bool randomBit, CellPos *outDestPos = nullptr)
+	{
+		static_assert(ArrayCount(gMovementPatterns[Movement].moves) == 5, "Try every move a pattern can hold");
+		s32 velocity = gMaterialLookup.velocity[type];
+		s32 xSign = randomBit ? 1 : -1;
+
+		bool moved = TryPatternMove<Movement, 0>(pos, type, context, xSign, velocity, outDestPos) ||
+			TryPatternMove<Movement, 1>(pos, type, context, xSign, velocity, outDestPos) ||
+			TryPatternMove<Movement, 2>(pos, type, context, xSign, velocity, outDestPos) ||
+			TryPatternMove<Movement, 3>(pos, type, context, xSign, velocity, outDestPos) ||
+			TryPatternMove<Movement, 4>(pos, type, context, xSign, velocity, outDestPos);
+		return moved;
+	}
+
+	// Same as UpdateMovingPixel, but the move to take is looked up from the pixel's neighbourhood bits,
+	// so only that one is tested. It can't be blocked, as its first step is known to be open
+	template<MovementClass Movement>
+	bool UpdateMovingPixelFromNeighbourhood(CellPos pos, PixelType type, RegionUpdateContext *context, bool randomBit,
+		u32 neighbourBits, CellPos *outDestPos)
+	{
+		static_assert(CanUseNeighbourhoodMoves(), "Some move doesn't start with a step to a neighbour");
+		s32 velocity = gMaterialLookup.velocity[type];
+		s32 xSign = randomBit ? 1 : -1;
+
+		u32 moveNum = gNeighbourhoodMoves.moves[Movement - MOVEMENT_POWDER][GetNeighbourhoodKey(neighbourBits, randomBit)];
+		bool moved = false;
+		switch(moveNum)
+		{
+		case 0: { moved = TryPatternMove<Movement, 0>(pos, type, context, xSign, velocity, outDestPos); } break;
+		case 1: { moved = TryPatternMove<Movement, 1>(pos, type, context, xSign, velocity, outDestPos); } break;
+		case 2: { moved = TryPatternMove<Movement, 2>(pos, type, context, xSign, velocity, outDestPos); } break;
+		case 3: { moved = TryPatternMove<Movement, 3>(pos, type, context, xSign, velocity, outDestPos); } break;
+		case 4: { moved = TryPatternMove<Movement, 4>(pos, type, context, xSign, velocity, outDestPos); } break;
+		default: Assert(moveNum == NoNeighbourhoodMove);
+		}
+		Assert(moved == (moveNum != NoNeighbourhoodMove));
+		return moved;
+	}
+
+	// Only the classes in ClassMask are checked for, so a region holding a single class pays for one compare.
+	// With the neighbourhood lookup on, neighbourBits picks the move. Returns true if the pixel moved, to outDestPos
+	template<u32 ClassMask>
+	inline bool UpdatePixelOfClasses(CellPos pos, PixelType type, MovementClass movement, RegionUpdateContext *context, bool randomBit,
+		u32 neighbourBits, CellPos *outDestPos)
+	{
+		bool moved = false;
+		if((ClassMask & GetMovingClassBit(MOVEMENT_POWDER)) && movement == MOVEMENT_POWDER)
+		{
+			moved = gNeighbourhoodLookup ?
+				UpdateMovingPixelFromNeighbourhood<MOVEMENT_POWDER>(pos, type, context, randomBit, neighbourBits, outDestPos) :
+				UpdateMovingPixel<MOVEMENT_POWDER>(pos, type, context, randomBit, outDestPos);
+		}
+		else if((ClassMask & GetMovingClassBit(MOVEMENT_LIQUID)) && movement == MOVEMENT_LIQUID)
+		{
+			moved = gNeighbourhoodLookup ?
+				UpdateMovingPixelFromNeighbourhood<MOVEMENT_LIQUID>(pos, type, context, randomBit, neighbourBits, outDestPos) :
+				UpdateMovingPixel<MOVEMENT_LIQUID>(pos, type, context, randomBit, outDestPos);
+		}
+		else if((ClassMask & GetMovingClassBit(MOVEMENT_GAS)) && movement == MOVEMENT_GAS)
+		{
+			moved = gNeighbourhoodLookup ?
+				UpdateMovingPixelFromNeighbourhood<MOVEMENT_GAS>(pos, type, context, randomBit, neighbourBits, outDestPos) :
+				UpdateMovingPixel<MOVEMENT_GAS>(pos, type, context, randomBit, outDestPos);
+		}
+		return moved;
+	}
+
+	// Calls spanFunc(spanStart, count) for runs of a row in [startX, endX) up to 64 pixels long that stay within a tile.
+	// In row major tiles each run is contiguous in the planes
+	template<typename SpanFunc>
+	inline void ForEachRowSpan(s32 startX, s32 endX, SpanFunc spanFunc)
+	{
+		for(s32 spanStart = startX; spanStart < endX;)
+		{
+			s32 tileEnd = (spanStart | (s32)m_layout.tileMask) + 1;
+			s32 spanEnd = MIN(MIN(tileEnd, endX), spanStart + 64);
+			spanFunc(spanStart, (u32)(spanEnd - spanStart));
+			spanStart = spanEnd;
+		}
+	}
+
+	// ORs count bits into a row of words at bitOffset, which may straddle two words
+	inline void OrRowBits(u64 *rowBits, u32 bitOffset, u64 bits, u32 count)
+	{
+		u32 bitIndex = bitOffset % 64;
+		rowBits[bitOffset / 64] |= bits << bitIndex;
+		if(bitIndex + count > 64)
+		{
+			rowBits[(bitOffset / 64) + 1] |= bits >> (64 - bitIndex);
+		}
+	}
+
+	// Bits for count pixels (up to 64) of a row from x on, set where the type is in typeMask. The pixels must be within a tile
+	inline u64 GetSpanTypeBits(s32 x, s32 y, u32 count, const MaterialMask &typeMask)
+	{
+		u64 result = 0;
+		if(gTileMortonOrder)
+		{
+			for(u32 pixelNum = 0; pixelNum < count; ++pixelNum)
+			{
+				result |= (u64)HasMaterial(typeMask, GetPixelType(x + pixelNum, y)) << pixelNum;
+			}
+		}
+		else if constexpr(MaterialCount <= TypeSetTableSize)
+		{
+			result = GetTypeSetMask((const u8 *)&m_pixelTypes[GetPixelOffset(x, y)], count, (u32)typeMask.words[0]);
+		}
+		else
+		{
+			// Too many materials for the shuffle, so each run of consecutive types in the mask is matched as a range,
+			// from a compare against its first type and one against the type after its last
+			const u8 *types = (const u8 *)&m_pixelTypes[GetPixelOffset(x, y)];
+			u32 runStart = 0;
+			while(runStart < MaterialCount)
+			{
+				if(!HasMaterial(typeMask, runStart))
+				{
+					++runStart;
+					continue;
+				}
+
+				u32 runEnd = runStart + 1;
+				while(runEnd < MaterialCount && HasMaterial(typeMask, runEnd))
+				{
+					++runEnd;
+				}
+				u64 runBits = GetMovableMask(types, count, (u8)runStart);
+				if(runEnd < MaterialCount)
+				{
+					runBits &= ~GetMovableMask(types, count, (u8)runEnd);
+				}
+				result |= runBits;
+				runStart = runEnd;
+			}
+		}
+		return result;
+	}
+
+	// One bit for each pixel of row y in [startX, endX) that holds a moving material and has not been updated yet,
+	// from word firstWord on
+	void FillRowCandidateBits(s32 y, s32 startX, s32 endX, u32 firstWord, u32 wordCount, u64 *outBits)
+	{
+		memset(outBits, 0, wordCount * sizeof(u64));
+
+		ForEachRowSpan(startX, endX, [&](s32 spanStart, u32 count) {
+			u64 candidates = 0;
+			if(gTileMortonOrder)
+			{
+				for(u32 pixelNum = 0; pixelNum < count; ++pixelNum)
+				{
+					candidates |= (u64)IsMovingMaterial(GetPixelType(spanStart + pixelNum, y)) << pixelNum;
+				}
+			}
+			else
+			{
+				candidates = GetMovableMask((const u8 *)&m_pixelTypes[GetPixelOffset(spanStart, y)], count, FirstMovingType);
+			}
+			candidates &= ~GetUpdatedBits(spanStart, y, count);
+			OrRowBits(outBits, spanStart - (firstWord * 64), candidates, count);
+		});
+	}
+
+	// Bits for the pixels of row y in [startX, endX) with a type in typeMask, from word firstWord on.
+	// Pixels already updated this step are left out when excludeUpdated is set
+	void FillRowTypeBits(s32 y, s32 startX, s32 endX, s32 firstWord, u32 wordCount, const MaterialMask &typeMask, bool excludeUpdated, u64 *outBits)
+	{
+		memset(outBits, 0, wordCount * sizeof(u64));
+		ForEachRowSpan(startX, endX, [&](s32 spanStart, u32 count) {
+			u64 typeBits = GetSpanTypeBits(spanStart, y, count, typeMask);
+			if(excludeUpdated)
+			{
+				typeBits &= ~GetUpdatedBits(spanStart, y, count);
+			}
+			OrRowBits(outBits, spanStart - (firstWord * 64), typeBits, count);
+		});
+	}
+
+	// Scan of a region's update bounds, bottom to top, with the row direction and the movement classes
+	// that can be found fixed at compile time. Each row is first reduced to a bitmask of pixels that can move,
+	// so runs of empty, static or already updated pixels are skipped without being visited
+	template<u32 ClassMask, bool Reverse>
+	void UpdateRegionPixels(RegionUpdateContext *context, s32 startX, s32 endX, s32 startY, s32 endY)
+	{
+		u64 rowRandomBits[MaxRowRandomWords];
+		u64 rowCandidateBits[MaxRowRandomWords];
+		u32 firstWord = startX / 64;
+		u32 wordCount = (((endX - 1) / 64) + 1) - firstWord;
+
+		PassableRows passableRows;
+		if(gNeighbourhoodLookup)
+		{
+			InitPassableRows(&passableRows, startX, endX, endY);
+		}
+		ChangedCellRows changedRows;
+		if(context->narrowRows)
+		{
+			InitChangedCellRows(&changedRows, startX, endX, endY);
+		}
+
+		for(s32 y = (endY - 1); y >= startY; --y)
+		{
+			if(gNeighbourhoodLookup)
+			{
+				AdvancePassableRows(&passableRows, y);
+			}
+
+			s32 rowStartX, rowEndX;
+			if(!GetRowScanBounds(context, &changedRows, y, startX, endX, &rowStartX, &rowEndX) ||
+				(gSkipStaticBlocks && !TrimRowToMovingBlocks(y, &rowStartX, &rowEndX)))
+			{
+				continue;
+			}
+			FillRowCandidateBits(y, rowStartX, rowEndX, firstWord, wordCount, rowCandidateBits);
+
+			bool randomBitsFilled = false;
+			for(u32 wordNum = 0; wordNum < wordCount; ++wordNum)
+			{
+				u32 wordIndex = Reverse ? (wordCount - 1 - wordNum) : wordNum;
+				u64 candidates = rowCandidateBits[wordIndex];
+				while(candidates)
+				{
+					u32 bitIndex;
+					if(Reverse)
+					{
+						bitIndex = 63 - CountLeadingZeros64(candidates);
+						candidates &= ~(1ULL << bitIndex);
+					}
+					else
+					{
+						bitIndex = CountTrailingZeros64(candidates);
+						candidates &= candidates - 1;
+					}
+					s32 x = ((firstWord + wordIndex) * 64) + bitIndex;
+
+					// Earlier pixels of this row may have moved into it since the row was scanned
+					if(IsPixelUpdated(x, y))
+					{
+						continue;
+					}
+
+					CellPos pos = GetCellPos(x, y);
+					PixelType type = GetPixelType(pos);
+					MovementClass movement = gMaterialLookup.movement[type];
+					if(movement >= MOVEMENT_POWDER)
+					{
+						if(!randomBitsFilled)
+						{
+							FillRowRandomBits(y, startX, endX, rowRandomBits);
+							randomBitsFilled = true;
+						}
+						bool randomBit = (rowRandomBits[wordIndex] >> bitIndex) & 1;
+
+						u32 neighbourBits = 0;
+						if(gNeighbourhoodLookup)
+						{
+							if(!HasMaterial(passableRows.types, type))
+							{
+								FillPassableRows(&passableRows, type);
+							}
+							u32 bitOffset = (u32)(x - 1 - (passableRows.firstWord * 64));
+							for(s32 rowNum = 0; rowNum < 3; ++rowNum)
+							{
+								const u64 *rowBits = passableRows.bits[type][GetPassableRowSlot(y + rowNum - 1)];
+								neighbourBits |= GetRowBitsAround(rowBits, bitOffset) << (rowNum * 3);
+							}
+						}
+
+						CellPos destPos;
+						if(!UpdatePixelOfClasses<ClassMask>(pos, type, movement, context, randomBit, neighbourBits, &destPos))
+						{
+							continue;
+						}
+						if(gNeighbourhoodLookup)
+						{
+							UpdatePassableRows(&passableRows, pos);
+							UpdatePassableRows(&passableRows, destPos);
+						}
+
+						// Pixels next to the ones that just changed are now active, which can reach past the row's span
+						// ahead of the scan. Those are added to the row's candidates
+						if(context->narrowRows)
+						{
+							s32 changedMinX = x;
+							s32 changedMaxX = x;
+							if(abs(destPos.y - y) <= 1)
+							{
+								changedMinX = MIN(changedMinX, destPos.x);
+								changedMaxX = MAX(changedMaxX, destPos.x);
+							}
+
+							s32 extendStartX = Reverse ? MAX(changedMinX - 1, startX) : rowEndX;
+							s32 extendEndX = Reverse ? rowStartX : MIN(changedMaxX + 2, endX);
+							if(extendStartX < extendEndX)
+							{
+								u64 extendBits[MaxRowRandomWords];
+								FillRowCandidateBits(y, extendStartX, extendEndX, firstWord, wordCount, extendBits);
+								for(u32 extendIndex = 0; extendIndex < wordCount; ++extendIndex)
+								{
+									rowCandidateBits[extendIndex] |= extendBits[extendIndex];
+								}
+								candidates |= extendBits[wordIndex];
+								rowStartX = MIN(rowStartX, extendStartX);
+								rowEndX = MAX(rowEndX, extendEndX);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Bits for the rows above, at and below row y, of the pixels each mover type in types can move into.
+	// Rows are laid out from the word holding the pixel left of startX, so both neighbours of every pixel are in range
+	struct PassableRows
+	{
+		s32 startX;
+		s32 endX;
+		s32 y;
+		s32 firstWord;
+		u32 wordCount;
+		MaterialMask types;
+		u64 bits[MaterialCount][3][MaxRowRandomWords]; // Rows are kept in the slot GetPassableRowSlot gives
+	};
+
+	inline u32 GetPassableRowSlot(s32 y)
+	{
+		return (u32)(y + m_layout.borderSize) % 3;
+	}
+
+	void InitPassableRows(PassableRows *rows, s32 startX, s32 endX, s32 endY)
+	{
+		rows->startX = startX;
+		rows->endX = endX;
+		rows->y = endY;
+		rows->firstWord = ((startX + 63) / 64) - 1;
+		rows->wordCount = (u32)((endX / 64) - rows->firstWord + 1);
+		rows->types = {};
+		Assert(rows->wordCount <= MaxRowRandomWords);
+	}
+
+	inline void FillPassableRow(PassableRows *rows, u32 type, s32 y)
+	{
+		FillRowTypeBits(y, rows->startX - 1, rows->endX + 1, rows->firstWord, rows->wordCount,
+			gMaterialLookup.passableTypes[type], false, rows->bits[type][GetPassableRowSlot(y)]);
+	}
+
+	void FillPassableRows(PassableRows *rows, PixelType type)
+	{
+		for(s32 rowNum = 0; rowNum < 3; ++rowNum)
+		{
+			FillPassableRow(rows, type, rows->y + rowNum - 1);
+		}
+		rows->types |= GetMaterialBit(type);
+	}
+
+	// Moves up a row. The rows kept are already up to date, so only the new row above is read
+	void AdvancePassableRows(PassableRows *rows, s32 y)
+	{
+		Assert(y == rows->y - 1);
+		rows->y = y;
+		ForEachMaterial(rows->types, [&](PixelType moverType) {
+			FillPassableRow(rows, moverType, y - 1);
+		});
+	}
+
+	// Keeps the rows in step with a pixel that has just changed, so they never have to be read again
+	inline void UpdatePassableRows(PassableRows *rows, CellPos pos)
+	{
+		u32 rowNum = (u32)(pos.y - rows->y + 1);
+		u32 bitOffset = (u32)(pos.x - (rows->firstWord * 64));
+		if(rowNum < 3 && bitOffset < (rows->wordCount * 64))
+		{
+			PixelType newType = GetPixelType(pos);
+			u64 bit = 1ULL << (bitOffset % 64);
+			u32 slot = GetPassableRowSlot(pos.y);
+			ForEachMaterial(rows->types, [&](PixelType moverType) {
+				u64 *word = &rows->bits[moverType][slot][bitOffset / 64];
+				*word = HasMaterial(gMaterialLookup.passableTypes[moverType], newType) ? (*word | bit) : (*word & ~bit);
+			});
+		}
+	}
+
+	typedef void (PixelSim::*RegionKernel)(RegionUpdateContext *context, s32 startX, s32 endX, s32 startY, s32 endY);
+
+	// Moves every pixel flagged in moveBits, from row y down a row and xOffset across, into pixels that are empty.
+	// Moves within the region being updated skip the general MovePixel bookkeeping, as its material counts stay the same
+	// and its dirty rect only needs growing once for the whole row. Only a move into another occupancy block is counted
+	void ApplyRowMoves(RegionUpdateContext *context, s32 y, s32 firstWord, u32 wordCount, const u64 *moveBits, s32 xOffset)
+	{
+		s32 regionMinX, regionMaxX, regionMinY, regionMaxY;
+		GetRegionBounds(context->regionIndex, &regionMinX, &regionMaxX, &regionMinY, &regionMaxY);
+		bool rowsInRegion = !gTileMortonOrder && y >= regionMinY && (y + 1) <= regionMaxY;
+		s32 indexDelta = rowsInRegion ? m_layout.GetIndexDelta(xOffset, 1) : 0;
+
+		s32 movedMinX = regionMaxX;
+		s32 movedMaxX = regionMinX - 1;
+		u64 movedBits[MaxRowRandomWords] = {};
+		for(u32 wordIndex = 0; wordIndex < wordCount; ++wordIndex)
+		{
+			for(u64 bits = moveBits[wordIndex]; bits; bits &= bits - 1)
+			{
+				s32 x = ((firstWord + (s32)wordIndex) * 64) + CountTrailingZeros64(bits);
+				CellPos srcPos = GetCellPos(x, y);
+
+				s32 destX = x + xOffset;
+				if(rowsInRegion && MIN(x, destX) >= regionMinX && MAX(x, destX) <= regionMaxX)
+				{
+					CellPos destPos = {destX, y + 1, srcPos.index + indexDelta};
+					Assert(m_pixelTypes[destPos.index] == PixelType::NONE);
+					m_pixelTypes[destPos.index] = m_pixelTypes[srcPos.index];
+					m_pixelColorVariants[destPos.index] = m_pixelColorVariants[srcPos.index];
+					m_pixelTypes[srcPos.index] = PixelType::NONE;
+					m_pixelColorVariants[srcPos.index] = 0;
+					MarkPixelUpdated(destPos, context);
+					movedBits[wordIndex] |= bits & (0 - bits);
+
+					u32 srcBlockIndex = GetOccupancyBlockIndex(x, y);
+					u32 destBlockIndex = GetOccupancyBlockIndex(destX, y + 1);
+					if(srcBlockIndex != destBlockIndex)
+					{
+						PixelType type = m_pixelTypes[destPos.index];
+						u32 countWord = GetBlockCountWord(type);
+						u64 countUnit = GetBlockCountUnit(type);
+						m_blockMaterialCounts[srcBlockIndex].words[countWord] -= countUnit;
+						m_blockMaterialCounts[destBlockIndex].words[countWord] += countUnit;
+					}
+
+					movedMinX = MIN(movedMinX, MIN(x, destX));
+					movedMaxX = MAX(movedMaxX, MAX(x, destX));
+				}
+				else
+				{
+					MovePixel(srcPos, GetNeighbourCell(srcPos, xOffset, 1), context);
+				}
+			}
+		}
+
+		if(movedMinX <= movedMaxX)
+		{
+			ExpandDirtyRect(&context->workerDirtyRects[context->regionIndex], movedMinX - 1, movedMaxX + 1, y - 1, y + 2);
+			if(gChangedCellCost > 0)
+			{
+				MarkRowCellsChanged(context->regionIndex, y, firstWord, wordCount, movedBits, 0);
+				MarkRowCellsChanged(context->regionIndex, y + 1, firstWord, wordCount, movedBits, xOffset);
+			}
+		}
+	}
+
+	// The bit sliced kernel works out the powder movement pattern for 64 pixels at a time
+	static constexpr bool CanBitSlicePowder()
+	{
+		constexpr MovementPattern pattern = gMovementPatterns[MOVEMENT_POWDER];
+		bool result = !pattern.tracePath && pattern.moveCount == 3 &&
+			pattern.moves[0][0] == 0 && pattern.moves[0][1] == 1 &&
+			pattern.moves[1][0] == 1 && pattern.moves[1][1] == 1 &&
+			pattern.moves[2][0] == -1 && pattern.moves[2][1] == 1;
+		for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+		{
+			result = result && (gMaterialDefs[typeNum].movement != MOVEMENT_POWDER || gMaterialDefs[typeNum].maxVelocity == 1);
+		}
+		return result;
+	}
+
+	// Region scan for areas holding only powder. Each row pair is turned into bitmasks of the powder above and the open
+	// pixels below, and which pixels fall straight down, or diagonally to the side each pixel's random bit picks and
+	// then the other side, is decided for a word of pixels at once. The result is the same as the per pixel scan, so
+	// pixels earlier in scan order get first pick of the open pixels. Rows with powder next to anything other than
+	// open or blocking pixels, such as a liquid to sink into, are left to the per pixel update in scan order
+	template<bool Reverse>
+	void UpdateRegionPowderBits(RegionUpdateContext *context, s32 startX, s32 endX, s32 startY, s32 endY)
+	{
+		static_assert(CanBitSlicePowder(), "Powder movement no longer matches the bit sliced kernel");
+		constexpr MaterialMask PowderTypes = GetMovementTypeMask(MOVEMENT_POWDER);
+		constexpr MaterialMask OpenTypes = GetPowderTargetTypeMask(POWDER_TARGET_OPEN);
+		constexpr MaterialMask OtherTypes = GetPowderTargetTypeMask(POWDER_TARGET_OTHER);
+
+		// Rows are laid out from the word holding the pixel left of startX, so moves to either side stay in range
+		s32 firstWord = ((startX + 63) / 64) - 1;
+		u32 wordCount = (u32)((endX / 64) - firstWord + 1);
+		Assert(wordCount <= MaxRowRandomWords);
+
+		// Pixels ahead in scan order are to the right going forwards, to the left in reverse
+		auto fromBehind = [&](const u64 *rowBits, u32 wordIndex, u32 shift) {
+			return Reverse ? GetRowBitsFromRight(rowBits, wordIndex, wordCount, shift) : GetRowBitsFromLeft(rowBits, wordIndex, shift);
+		};
+		auto fromAhead = [&](const u64 *rowBits, u32 wordIndex, u32 shift) {
+			return Reverse ? GetRowBitsFromLeft(rowBits, wordIndex, shift) : GetRowBitsFromRight(rowBits, wordIndex, wordCount, shift);
+		};
+
+		u64 powder[MaxRowRandomWords];
+		u64 open[MaxRowRandomWords];
+		u64 other[MaxRowRandomWords];
+		u64 randomBits[MaxRowRandomWords];
+		u64 moveDown[MaxRowRandomWords];
+		u64 moveAhead[MaxRowRandomWords];
+		u64 moveBehind[MaxRowRandomWords];
+
+		ChangedCellRows changedRows;
+		if(context->narrowRows)
+		{
+			InitChangedCellRows(&changedRows, startX, endX, endY);
+		}
+
+		// Powder falling only fills pixels of the row below, which can stop others on the row moving but never lets
+		// them start, so narrowed rows don't need extending as they are updated
+		for(s32 y = (endY - 1); y >= startY; --y)
+		{
+			s32 rowStartX, rowEndX;
+			if(!GetRowScanBounds(context, &changedRows, y, startX, endX, &rowStartX, &rowEndX) ||
+				(gSkipStaticBlocks && !TrimRowToMovingBlocks(y, &rowStartX, &rowEndX)))
+			{
+				continue;
+			}
+			FillRowTypeBits(y, rowStartX, rowEndX, firstWord, wordCount, PowderTypes, true, powder);
+
+			u64 anyPowder = 0;
+			for(u32 wordIndex = 0; wordIndex < wordCount; ++wordIndex)
+			{
+				anyPowder |= powder[wordIndex];
+			}
+			if(!anyPowder)
+			{
+				continue;
+			}
+
+			FillRowTypeBits(y + 1, rowStartX - 1, rowEndX + 1, firstWord, wordCount, OpenTypes, false, open);
+			FillRowTypeBits(y + 1, rowStartX - 1, rowEndX + 1, firstWord, wordCount, OtherTypes, false, other);
+
+			u64 anyPerPixel = 0;
+			for(u32 wordIndex = 0; wordIndex < wordCount; ++wordIndex)
+			{
+				s32 word = firstWord + (s32)wordIndex;
+				randomBits[wordIndex] = (word >= 0) ? GetRowRandomWord((u32)word, y) : 0;
+
+				u64 otherBelow = other[wordIndex] | GetRowBitsFromLeft(other, wordIndex, 1) | GetRowBitsFromRight(other, wordIndex, wordCount, 1);
+				anyPerPixel |= powder[wordIndex] & otherBelow;
+			}
+
+			if(anyPerPixel)
+			{
+				for(u32 wordNum = 0; wordNum < wordCount; ++wordNum)
+				{
+					u32 wordIndex = Reverse ? (wordCount - 1 - wordNum) : wordNum;
+					u64 bits = powder[wordIndex];
+					while(bits)
+					{
+						u32 bitIndex;
+						if(Reverse)
+						{
+							bitIndex = 63 - CountLeadingZeros64(bits);
+							bits &= ~(1ULL << bitIndex);
+						}
+						else
+						{
+							bitIndex = CountTrailingZeros64(bits);
+							bits &= bits - 1;
+						}
+						s32 x = ((firstWord + (s32)wordIndex) * 64) + bitIndex;
+
+						// Earlier pixels of this row may have swapped into it
+						if(IsPixelUpdated(x, y))
+						{
+							continue;
+						}
+						CellPos pos = GetCellPos(x, y);
+						bool randomBit = (randomBits[wordIndex] >> bitIndex) & 1;
+						UpdateMovingPixel<MOVEMENT_POWDER>(pos, GetPixelType(pos), context, randomBit);
+					}
+				}
+				continue;
+			}
+
+			// A pixel's moves only depend on the moves of the two pixels before it in scan order, which can take the
+			// spots below and behind it. Words are decided in scan order, and within a word the moves ahead are found
+			// again from the last guess until they stop changing. Each pass settles at least one more pixel, so that
+			// ends within a word's worth of passes, and only on the same moves a pixel at a time would make
+			memset(moveAhead, 0, wordCount * sizeof(u64));
+			memset(moveDown, 0, wordCount * sizeof(u64));
+			for(u32 wordNum = 0; wordNum < wordCount; ++wordNum)
+			{
+				u32 wordIndex = Reverse ? (wordCount - 1 - wordNum) : wordNum;
+				u64 aheadFirst = Reverse ? ~randomBits[wordIndex] : randomBits[wordIndex];
+				u64 canAhead = fromAhead(open, wordIndex, 1);
+				u64 canBehind;
+				for(;;)
+				{
+					moveDown[wordIndex] = powder[wordIndex] & open[wordIndex] & ~fromBehind(moveAhead, wordIndex, 1);
+					canBehind = fromBehind(open, wordIndex, 1) & ~fromBehind(moveAhead, wordIndex, 2) & ~fromBehind(moveDown, wordIndex, 1);
+					u64 ahead = powder[wordIndex] & ~moveDown[wordIndex] & canAhead & (aheadFirst | ~canBehind);
+					if(ahead == moveAhead[wordIndex])
+					{
+						break;
+					}
+					moveAhead[wordIndex] = ahead;
+				}
+				moveBehind[wordIndex] = powder[wordIndex] & ~moveDown[wordIndex] & ~moveAhead[wordIndex] & canBehind;
+			}
+
+			// Every move lands on a different open pixel in the row below, so the order they are applied in doesn't matter
+			ApplyRowMoves(context, y, firstWord, wordCount, moveDown, 0);
+			ApplyRowMoves(context, y, firstWord, wordCount, moveAhead, Reverse ? -1 : 1);
+			ApplyRowMoves(context, y, firstWord, wordCount, moveBehind, Reverse ? 1 : -1);
+		}
+	}
+
+	// ORs the changed cells of row y in [startX, endX) into a row of bits laid out from word firstWord. The pixels can
+	// belong to a few regions, and workers updating the regions around them can be marking their cells, so words are
+	// read atomically
+	void OrChangedCellRow(u64 *changedCells, s32 y, s32 startX, s32 endX, s32 firstWord, u64 *outBits)
+	{
+		startX = MAX(startX, 0);
+		endX = MIN(endX, (s32)m_simWidth);
+		if((u32)y >= m_simHeight)
+		{
+			return;
+		}
+
+		for(s32 regionX = startX & ~(s32)m_layout.tileMask; regionX < endX; regionX += m_regionPixelSize)
+		{
+			u64 *rowCells = GetRegionChangedCells(changedCells, GetRegionIndex(regionX, y)) +
+				(((y & m_layout.tileMask) + 1) * m_changedCellRowWords);
+			s32 spanEnd = MIN(endX, regionX + (s32)m_regionPixelSize);
+			for(s32 x = MAX(startX, regionX); x < spanEnd; x += 64)
+			{
+				u32 count = (u32)MIN(spanEnd - x, 64);
+				u32 bitNum = (u32)(x - regionX) + 1;
+				u32 bitIndex = bitNum % 64;
+				u64 bits = AtomicLoad64(&rowCells[bitNum / 64]) >> bitIndex;
+				if(bitIndex > 0 && ((bitNum / 64) + 1) < m_changedCellRowWords)
+				{
+					bits |= AtomicLoad64(&rowCells[(bitNum / 64) + 1]) << (64 - bitIndex);
+				}
+				OrRowBits(outBits, (u32)(x - (firstWord * 64)), MaskScanBits(bits, count), count);
+			}
+		}
+	}
+
+	// Cells changed last step, so far this step, or before a region went to sleep, on the rows above, at and below row y,
+	// and a pixel either side of [startX, endX). Laid out like PassableRows
+	struct ChangedCellRows
+	{
+		s32 startX;
+		s32 endX;
+		s32 y;
+		s32 firstWord;
+		u32 wordCount;
+		u64 bits[3][MaxRowRandomWords]; // Rows are kept in the slot GetPassableRowSlot gives
+	};
+
+	void FillChangedCellRow(ChangedCellRows *rows, s32 y)
+	{
+		u64 *rowBits = rows->bits[GetPassableRowSlot(y)];
+		memset(rowBits, 0, rows->wordCount * sizeof(u64));
+		for(u32 bufferNum = 0; bufferNum < DirtyRectBufferCount; ++bufferNum)
+		{
+			OrChangedCellRow(m_changedCellBuffers[bufferNum], y, rows->startX - 1, rows->endX + 1, rows->firstWord, rowBits);
+		}
+		OrChangedCellRow(m_sleepChangedCells, y, rows->startX - 1, rows->endX + 1, rows->firstWord, rowBits);
+	}
+
+	void InitChangedCellRows(ChangedCellRows *rows, s32 startX, s32 endX, s32 endY)
+	{
+		rows->startX = startX;
+		rows->endX = endX;
+		rows->y = endY;
+		rows->firstWord = ((startX + 63) / 64) - 1;
+		rows->wordCount = (u32)((endX / 64) - rows->firstWord + 1);
+		Assert(rows->wordCount <= MaxRowRandomWords);
+		FillChangedCellRow(rows, endY);
+		FillChangedCellRow(rows, endY - 1);
+	}
+
+	// Moves up a row. Of the rows kept, updating the rows below can only have changed them in the write buffer, so just
+	// that is read again
+	void AdvanceChangedCellRows(ChangedCellRows *rows, s32 y)
+	{
+		Assert(y == rows->y - 1);
+		rows->y = y;
+		FillChangedCellRow(rows, y - 1);
+		for(s32 rowY = y; rowY <= (y + 1); ++rowY)
+		{
+			OrChangedCellRow(m_changedCellBuffers[m_writeRegionBufferIndex], rowY, rows->startX - 1, rows->endX + 1,
+				rows->firstWord, rows->bits[GetPassableRowSlot(rowY)]);
+		}
+	}
+
+	// Active cells of the row the changed cell rows are at, those in [startX, endX) within a pixel of a changed cell
+	void FillActiveCellRow(const ChangedCellRows *rows, u64 *outBits)
+	{
+		u64 changed[MaxRowRandomWords];
+		for(u32 wordIndex = 0; wordIndex < rows->wordCount; ++wordIndex)
+		{
+			changed[wordIndex] = rows->bits[0][wordIndex] | rows->bits[1][wordIndex] | rows->bits[2][wordIndex];
+		}
+		for(u32 wordIndex = 0; wordIndex < rows->wordCount; ++wordIndex)
+		{
+			s32 wordX = (rows->firstWord + (s32)wordIndex) * 64;
+			u32 rowStart = (u32)MIN(MAX(rows->startX - wordX, 0), 64);
+			u32 rowEnd = (u32)MIN(MAX(rows->endX - wordX, 0), 64);
+			u64 rowMask = (rowEnd > rowStart) ? (MaskScanBits(~0ULL, rowEnd - rowStart) << rowStart) : 0;
+			outBits[wordIndex] = (changed[wordIndex] | GetRowBitsFromLeft(changed, wordIndex, 1) |
+				GetRowBitsFromRight(changed, wordIndex, rows->wordCount, 1)) & rowMask;
+		}
+	}
+
+	// Changed cells within a region's dirty rect, the only rows that can hold any
+	u32 CountRegionChangedCells(const u64 *regionCells, s32 firstRowY, DirtyRect dirtyRect)
+	{
+		const u64 *firstRowCells = regionCells + ((dirtyRect.minY - firstRowY) * m_changedCellRowWords);
+		u32 wordCount = (u32)(dirtyRect.maxY - dirtyRect.minY + 1) * m_changedCellRowWords;
+		u32 result = 0;
+		for(u32 wordIndex = 0; wordIndex < wordCount; ++wordIndex)
+		{
+			result += CountSetBits64(firstRowCells[wordIndex]);
+		}
+		return result;
+	}
+
+	// Visits just the active cells of a region, bottom to top in the order the scan would reach them, with the same
+	// per pixel update. For a few pixels moving through an otherwise settled region, where scanning rows is mostly wasted
+	template<bool Reverse>
+	void UpdateRegionActiveCells(RegionUpdateContext *context, s32 startX, s32 endX, s32 startY, s32 endY)
+	{
+		ChangedCellRows changedRows;
+		InitChangedCellRows(&changedRows, startX, endX, endY);
+		s32 firstWord = changedRows.firstWord;
+		u32 wordCount = changedRows.wordCount;
+		for(s32 y = (endY - 1); y >= startY; --y)
+		{
+			AdvanceChangedCellRows(&changedRows, y);
+			u64 activeCells[MaxRowRandomWords];
+			FillActiveCellRow(&changedRows, activeCells);
+
+			s32 randomWordIndex = -1;
+			u64 randomWord = 0;
+			for(u32 wordNum = 0; wordNum < wordCount; ++wordNum)
+			{
+				u32 wordIndex = Reverse ? (wordCount - 1 - wordNum) : wordNum;
+				u64 cells = activeCells[wordIndex];
+				while(cells)
+				{
+					u32 bitIndex;
+					if(Reverse)
+					{
+						bitIndex = 63 - CountLeadingZeros64(cells);
+						cells &= ~(1ULL << bitIndex);
+					}
+					else
+					{
+						bitIndex = CountTrailingZeros64(cells);
+						cells &= cells - 1;
+					}
+					s32 x = ((firstWord + (s32)wordIndex) * 64) + (s32)bitIndex;
+
+					// Most active cells are empty or static, so those are ruled out before anything else
+					CellPos pos = GetCellPos(x, y);
+					PixelType type = GetPixelType(pos);
+					MovementClass movement = gMaterialLookup.movement[type];
+					if(movement < MOVEMENT_POWDER || IsPixelUpdated(x, y))
+					{
+						continue;
+					}
+
+					if(randomWordIndex != (x / 64))
+					{
+						randomWordIndex = x / 64;
+						randomWord = GetRowRandomWord(randomWordIndex, y);
+					}
+					bool randomBit = (randomWord >> (x % 64)) & 1;
+
+					CellPos destPos;
+					bool moved = false;
+					switch(movement)
+					{
+						case MOVEMENT_POWDER:
+							moved = UpdateMovingPixel<MOVEMENT_POWDER>(pos, type, context, randomBit, &destPos);
+							break;
+						case MOVEMENT_LIQUID:
+							moved = UpdateMovingPixel<MOVEMENT_LIQUID>(pos, type, context, randomBit, &destPos);
+							break;
+						case MOVEMENT_GAS:
+							moved = UpdateMovingPixel<MOVEMENT_GAS>(pos, type, context, randomBit, &destPos);
+							break;
+						default:
+							break;
+					}
+					if(!moved)
+					{
+						continue;
+					}
+
+					// Cells of this row next to the pixels that just changed are now active too, from the next one in
+					// scan order, the same as the scan extends its row
+					s32 changedMinX = x;
+					s32 changedMaxX = x;
+					if(abs(destPos.y - y) <= 1)
+					{
+						changedMinX = MIN(changedMinX, destPos.x);
+						changedMaxX = MAX(changedMaxX, destPos.x);
+					}
+					s32 activeStartX = Reverse ? MAX(changedMinX - 1, startX) : (x + 1);
+					s32 activeEndX = Reverse ? x : MIN(changedMaxX + 2, endX);
+					for(s32 activeX = activeStartX; activeX < activeEndX; ++activeX)
+					{
+						u32 bitOffset = (u32)(activeX - (firstWord * 64));
+						u64 bit = 1ULL << (bitOffset % 64);
+						activeCells[bitOffset / 64] |= bit;
+						if((bitOffset / 64) == wordIndex)
+						{
+							cells |= bit;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	template<u32 ClassMask>
+	void AddRegionKernels()
+	{
+		m_regionKernels[ClassMask][0] = &PixelSim::UpdateRegionPixels<ClassMask, false>;
+		m_regionKernels[ClassMask][1] = &PixelSim::UpdateRegionPixels<ClassMask, true>;
+	}
+
+	// Track how many pixels of each material every region and occupancy block holds, as pixels change type.
+	// The region being updated owns its counts, but a neighbour's can be shared with another running region
+	inline void AdjustRegionMaterialCount(u32 regionIndex, PixelType type, s32 delta, RegionUpdateContext *context)
+	{
+		std::atomic<u32> *count = &m_regionMaterialCounts[regionIndex].counts[type];
+		if(context && context->regionIndex != regionIndex)
+		{
+			count->fetch_add((u32)delta, std::memory_order_relaxed);
+		}
+		else
+		{
+			count->store(count->load(std::memory_order_relaxed) + (u32)delta, std::memory_order_relaxed);
+		}
+	}
+
+	inline u32 GetOccupancyBlockIndex(s32 x, s32 y)
+	{
+		u32 blockIndex = ((y >> OccupancyBlockShift) * m_blockColumns) + (x >> OccupancyBlockShift);
+		return blockIndex;
+	}
+
+	// Blocks belong to the region around them, so are shared the same way as its counts
+	inline void AdjustBlockMaterialCounts(u32 blockIndex, u32 regionIndex, const BlockMaterialCounts &delta, RegionUpdateContext *context)
+	{
+		bool shared = context && context->regionIndex != regionIndex;
+		for(u32 wordNum = 0; wordNum < BlockCountWordCount; ++wordNum)
+		{
+			if(!delta.words[wordNum])
+			{
+				continue;
+			}
+
+			if(shared)
+			{
+				AtomicAdd64(&m_blockMaterialCounts[blockIndex].words[wordNum], delta.words[wordNum]);
+			}
+			else
+			{
+				m_blockMaterialCounts[blockIndex].words[wordNum] += delta.words[wordNum];
+			}
+		}
+	}
+
+	inline void OnPixelTypeChanged(CellPos pos, PixelType oldType, PixelType newType, RegionUpdateContext *context)
+	{
+		if(oldType != newType)
+		{
+			u32 regionIndex = GetRegionIndex(pos.x, pos.y);
+			BlockMaterialCounts blockDelta = {};
+			if(oldType != PixelType::NONE)
+			{
+				AdjustRegionMaterialCount(regionIndex, oldType, -1, context);
+				blockDelta.words[GetBlockCountWord(oldType)] -= GetBlockCountUnit(oldType);
+			}
+			if(newType != PixelType::NONE)
+			{
+				AdjustRegionMaterialCount(regionIndex, newType, 1, context);
+				blockDelta.words[GetBlockCountWord(newType)] += GetBlockCountUnit(newType);
+			}
+			AdjustBlockMaterialCounts(GetOccupancyBlockIndex(pos.x, pos.y), regionIndex, blockDelta, context);
+		}
+	}
+
+	inline u32 GetRegionClassMask(u32 regionIndex)
+	{
+		u32 classMask = 0;
+		for(u32 typeNum = FirstMovingType; typeNum < MaterialCount; ++typeNum)
+		{
+			if(m_regionMaterialCounts[regionIndex].counts[typeNum].load(std::memory_order_relaxed) > 0)
+			{
+				classMask |= GetMovingClassBit(gMaterialLookup.movement[typeNum]);
+			}
+		}
+		return classMask;
+	}
+
+	// Classes can only leave a region during a step, as anything moving in is already updated. Kernels are picked from
+	// what regions held at the start of the step, so the choice doesn't depend on what regions running alongside have done
+	void SnapshotRegionClassMasks()
+	{
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
+		{
+			m_regionClassMasks[regionIndex] = (u8)GetRegionClassMask(regionIndex);
+		}
+	}
+
+	// Moving classes held by every region the pixel bounds overlap, at the start of the step
+	u32 GetAreaClassMask(s32 startX, s32 endX, s32 startY, s32 endY)
+	{
+		s32 firstColumn = startX >> m_layout.tileShift;
+		s32 lastColumn = (endX - 1) >> m_layout.tileShift;
+		s32 firstRow = startY >> m_layout.tileShift;
+		s32 lastRow = (endY - 1) >> m_layout.tileShift;
+
+		u32 classMask = 0;
+		for(s32 rowNum = firstRow; rowNum <= lastRow; ++rowNum)
+		{
+			for(s32 colNum = firstColumn; colNum <= lastColumn; ++colNum)
+			{
+				classMask |= m_regionClassMasks[(rowNum * m_regionColumns) + colNum];
+			}
+		}
+		return classMask;
+	}
+
+	// Pixel bounds a region will scan this update, which is its dirty rect plus a pixel of padding
+	inline void GetRegionUpdateBounds(DirtyRect dirtyRect, s32 *startX, s32 *endX, s32 *startY, s32 *endY)
+	{
+		*startX = Clamp(dirtyRect.minX - 1, 0, m_simWidth);
+		*endX = Clamp(dirtyRect.maxX + 1, 0, m_simWidth);
+		*startY = Clamp(dirtyRect.minY - 1, 0, m_simHeight);
+		*endY = Clamp(dirtyRect.maxY + 1, 0, m_simHeight);
+	}
+
+	// Pixels of row y a region scans this update, [rowStartX, rowEndX), within [startX, endX). The whole row unless the
+	// region's rows are narrowed, then from its first active cell to its last, moving changedRows up to the row. Pixels
+	// moving along the row can make more active while it is scanned, which the per pixel scan extends the row for.
+	// False when the row has nothing to scan
+	inline bool GetRowScanBounds(RegionUpdateContext *context, ChangedCellRows *changedRows, s32 y, s32 startX, s32 endX, s32 *rowStartX, s32 *rowEndX)
+	{
+		*rowStartX = startX;
+		*rowEndX = endX;
+		if(context->narrowRows)
+		{
+			AdvanceChangedCellRows(changedRows, y);
+			u64 activeCells[MaxRowRandomWords];
+			FillActiveCellRow(changedRows, activeCells);
+
+			s32 firstWord = changedRows->firstWord;
+			s32 firstIndex = 0;
+			s32 lastIndex = (s32)changedRows->wordCount - 1;
+			while(firstIndex <= lastIndex && !activeCells[firstIndex])
+			{
+				++firstIndex;
+			}
+			while(lastIndex > firstIndex && !activeCells[lastIndex])
+			{
+				--lastIndex;
+			}
+			if(firstIndex > lastIndex)
+			{
+				return false;
+			}
+
+			*rowStartX = ((firstWord + firstIndex) * 64) + (s32)CountTrailingZeros64(activeCells[firstIndex]);
+			*rowEndX = ((firstWord + lastIndex) * 64) + 64 - (s32)CountLeadingZeros64(activeCells[lastIndex]);
+		}
+		return *rowStartX < *rowEndX;
+	}
+
+	// Whether any of a block's counts in countBytes are above zero. Blocks of neighbouring regions can be changing
+	inline bool BlockHasCounts(BlockMaterialCounts *blockCounts, const BlockMaterialCounts &countBytes)
+	{
+		u64 counts = 0;
+		for(u32 wordNum = 0; wordNum < BlockCountWordCount; ++wordNum)
+		{
+			if(countBytes.words[wordNum])
+			{
+				counts |= AtomicLoad64(&blockCounts->words[wordNum]) & countBytes.words[wordNum];
+			}
+		}
+		return counts != 0;
+	}
+
+	// Narrows a row's scan bounds to the occupancy blocks holding anything that moves, false when none of them do.
+	// Anything moving into a skipped block during the step has already been updated, so skipping it changes nothing
+	inline bool TrimRowToMovingBlocks(s32 y, s32 *rowStartX, s32 *rowEndX)
+	{
+		constexpr BlockMaterialCounts MovingCountBytes = GetBlockCountBytes(GetMovementTypeMask(MOVEMENT_POWDER) |
+			GetMovementTypeMask(MOVEMENT_LIQUID) | GetMovementTypeMask(MOVEMENT_GAS));
+
+		BlockMaterialCounts *rowBlocks = m_blockMaterialCounts + ((y >> OccupancyBlockShift) * m_blockColumns);
+		s32 firstBlock = *rowStartX >> OccupancyBlockShift;
+		s32 lastBlock = (*rowEndX - 1) >> OccupancyBlockShift;
+		while(firstBlock <= lastBlock && !BlockHasCounts(&rowBlocks[firstBlock], MovingCountBytes))
+		{
+			++firstBlock;
+		}
+		while(lastBlock > firstBlock && !BlockHasCounts(&rowBlocks[lastBlock], MovingCountBytes))
+		{
+			--lastBlock;
+		}
+		if(firstBlock > lastBlock)
+		{
+			return false;
+		}
+
+		*rowStartX = MAX(*rowStartX, firstBlock << OccupancyBlockShift);
+		*rowEndX = MIN(*rowEndX, (lastBlock + 1) << OccupancyBlockShift);
+		return true;
+	}
+
+	// Update the pixels of a single region, within the bounds of its dirty rect
+	void UpdateRegion(u32 regionIndex, DirtyRect *regionDirtyRects, bool evenFrame, u32 workerIndex)
+	{
+		DirtyRect dirtyRect = regionDirtyRects[regionIndex];
+
+		if(IsInvalidDirtyRect(dirtyRect))
+		{
+			return;
+		}
+
+		m_regionActiveCellUpdates[regionIndex] = 0;
+
+		RegionUpdateContext context = {};
+		context.regionIndex = regionIndex;
+		context.outboundMoves = &m_outboundMoveQueues[workerIndex];
+		context.workerDirtyRects = m_workerDirtyRects[workerIndex];
+		GetRegionBounds(regionIndex, &context.minX, &context.maxX, &context.minY, &context.maxY);
+		context.minX = MAX(context.minX - (s32)m_regionPixelSize, 0);
+		context.maxX = MIN(context.maxX + (s32)m_regionPixelSize, (s32)m_simWidth - 1);
+		context.minY = MAX(context.minY - (s32)m_regionPixelSize, 0);
+		context.maxY = MIN(context.maxY + (s32)m_regionPixelSize, (s32)m_simHeight - 1);
+
+		s32 startX, endX, startY, endY;
+		GetRegionUpdateBounds(dirtyRect, &startX, &endX, &startY, &endY);
+
+		// The scan reaches a little into neighbours, so their pixels count too. Areas of only empty and static
+		// pixels have nothing to update, otherwise use the kernel for just the classes present
+		u32 classMask = GetAreaClassMask(startX, endX, startY, endY);
+		if(classMask == 0)
+		{
+			return;
+		}
+
+		// Every pixel's first step goes to a neighbour, so a pixel can only start or stop being able to move next to a
+		// changed cell, and each row is scanned just across those. With few enough changes for the rect, the active cells
+		// are visited one by one instead of scanning the rows
+		context.narrowRows = gChangedCellCost > 0 && !m_fullRectScans;
+		bool visitActiveCells = false;
+		if(context.narrowRows)
+		{
+			u32 changedCellCount = CountRegionChangedCells(GetRegionChangedCells(m_changedCellBuffers[m_readRegionBufferIndex], regionIndex),
+				GetRegionFirstCellY(regionIndex), dirtyRect);
+			visitActiveCells = (changedCellCount * gChangedCellCost) < GetRegionCost(dirtyRect);
+		}
+		if(visitActiveCells)
+		{
+			m_regionActiveCellUpdates[regionIndex] = 1;
+			if(evenFrame)
+			{
+				UpdateRegionActiveCells<true>(&context, startX, endX, startY, endY);
+			}
+			else
+			{
+				UpdateRegionActiveCells<false>(&context, startX, endX, startY, endY);
+			}
+			return;
+		}
+
+		RegionKernel kernel = m_regionKernels[classMask][evenFrame ? 1 : 0];
+		(this->*kernel)(&context, startX, endX, startY, endY);
+	}
+
+	// Apply every worker's outbound moves, after the regions they were queued from have all updated.
+	// A move only goes ahead if neither pixel has changed since it was queued, otherwise the source is
+	// marked dirty to try again next frame
+	void ApplyCrossRegionMoves()
+	{
+		u32 moveCount = 0;
+		u32 workerCount = m_workerPool.GetThreadCount();
+		for(u32 workerNum = 0; workerNum < workerCount; ++workerNum)
+		{
+			moveCount += m_outboundMoveQueues[workerNum].count;
+		}
+		if(moveCount == 0)
+		{
+			return;
+		}
+
+		if(moveCount > m_sortedMoveCapacity)
+		{
+			m_sortedMoveCapacity = MAX(moveCount, m_sortedMoveCapacity * 2);
+			m_sortedMoves = (CrossRegionMove *)realloc(m_sortedMoves, m_sortedMoveCapacity * sizeof(CrossRegionMove));
+		}
+
+		u32 sortedCount = 0;
+		for(u32 workerNum = 0; workerNum < workerCount; ++workerNum)
+		{
+			CrossRegionMoveQueue *queue = &m_outboundMoveQueues[workerNum];
+			memcpy(m_sortedMoves + sortedCount, queue->moves, queue->count * sizeof(CrossRegionMove));
+			sortedCount += queue->count;
+			queue->count = 0;
+		}
+
+		// Which worker updated a region depends on timing, so in deterministic mode put the moves in canonical order.
+		// A region is only ever updated by one worker, so its moves share a queue and sequence numbers
+		if(m_deterministic)
+		{
+			std::sort(m_sortedMoves, m_sortedMoves + moveCount, [](const CrossRegionMove &a, const CrossRegionMove &b) {
+				return (a.srcRegionIndex != b.srcRegionIndex) ? (a.srcRegionIndex < b.srcRegionIndex) : (a.sequenceNum < b.sequenceNum);
+			});
+		}
+
+		for(u32 moveNum = 0; moveNum < moveCount; ++moveNum)
+		{
+			CrossRegionMove *move = &m_sortedMoves[moveNum];
+			if(GetPixelType(move->srcPos) != move->srcType || GetPixelType(move->destPos) != move->destType)
+			{
+				AddToDirtyRect(move->srcPos.x, move->srcPos.y);
+				continue;
+			}
+
+			if(move->swap)
+			{
+				SwapPixels(move->srcPos, move->destPos);
+			}
+			else
+			{
+				MovePixel(move->srcPos, move->destPos);
+			}
+		}
+	}
+
+	inline u32 GetRegionCost(DirtyRect dirtyRect)
+	{
+		s32 startX, endX, startY, endY;
+		GetRegionUpdateBounds(dirtyRect, &startX, &endX, &startY, &endY);
+		u32 cost = (u32)MAX((endX - startX) * (endY - startY), 1);
+		return cost;
+	}
+
+	// Fills outNeighbours with the indices of up to 8 surrounding regions, returning how many there are
+	u32 GetNeighbourRegions(u32 regionIndex, u32 *outNeighbours)
+	{
+		s32 colNum = regionIndex % m_regionColumns;
+		s32 rowNum = regionIndex / m_regionColumns;
+
+		u32 neighbourCount = 0;
+		for(s32 rowOffset = -1; rowOffset <= 1; ++rowOffset)
+		{
+			for(s32 colOffset = -1; colOffset <= 1; ++colOffset)
+			{
+				s32 neighbourCol = colNum + colOffset;
+				s32 neighbourRow = rowNum + rowOffset;
+				bool isSelf = (colOffset == 0 && rowOffset == 0);
+				if(!isSelf && neighbourCol >= 0 && neighbourCol < (s32)m_regionColumns &&
+					neighbourRow >= 0 && neighbourRow < (s32)m_regionRows)
+				{
+					outNeighbours[neighbourCount++] = (neighbourRow * m_regionColumns) + neighbourCol;
+				}
+			}
+		}
+		return neighbourCount;
+	}
+
+	// Position of a region's stage in this frame's update order
+	inline u32 GetRegionStageOrder(u32 regionIndex)
+	{
+		u32 stageOrder = (m_regionStageNums[regionIndex] + UPDATE_STAGE_COUNT - m_startingStageNum) % UPDATE_STAGE_COUNT;
+		return stageOrder;
+	}
+
+	// Hand out the regions that are ready at the start of a frame to the worker queues.
+	// Most expensive regions are placed first, each onto the queue with the least total cost so far
+	void SeedReadyQueues(u32 taskCount)
+	{
+		std::sort(m_readyTasks, m_readyTasks + taskCount, [](const RegionTask &a, const RegionTask &b) {
+			return (a.cost != b.cost) ? (a.cost > b.cost) : (a.regionIndex < b.regionIndex);
+		});
+
+		u32 workerCount = m_workerPool.GetThreadCount();
+		u64 *queueCosts = m_queueCosts;
+		for(u32 workerNum = 0; workerNum < workerCount; ++workerNum)
+		{
+			m_regionQueues[workerNum].Reset();
+			queueCosts[workerNum] = 0;
+		}
+
+		for(u32 taskNum = 0; taskNum < taskCount; ++taskNum)
+		{
+			u32 cheapestQueue = 0;
+			for(u32 workerNum = 1; workerNum < workerCount; ++workerNum)
+			{
+				if(queueCosts[workerNum] < queueCosts[cheapestQueue])
+				{
+					cheapestQueue = workerNum;
+				}
+			}
+			queueCosts[cheapestQueue] += m_readyTasks[taskNum].cost;
+			m_readyTasks[taskNum].queueIndex = cheapestQueue;
+		}
+
+		// Owners pop from the bottom, so fill each queue cheapest first and the owner starts on its largest region.
+		// Thieves then take the cheaper leftovers from the top
+		for(s32 taskNum = (s32)taskCount - 1; taskNum >= 0; --taskNum)
+		{
+			RegionTask *task = &m_readyTasks[taskNum];
+			m_regionQueues[task->queueIndex].Push(task->regionIndex);
+		}
+	}
+
+	// Try every other worker's queue until a region is taken or they are all empty
+	bool StealRegion(u32 workerIndex, u32 *outRegionIndex)
+	{
+		u32 workerCount = m_workerPool.GetThreadCount();
+		bool retry = true;
+		while(retry)
+		{
+			retry = false;
+			for(u32 victimNum = 1; victimNum < workerCount; ++victimNum)
+			{
+				WorkStealingDeque *victimQueue = &m_regionQueues[(workerIndex + victimNum) % workerCount];
+				StealResult result = victimQueue->Steal(outRegionIndex);
+				if(result == STEAL_SUCCESS)
+				{
+					return true;
+				}
+				retry |= (result == STEAL_ABORT);
+			}
+		}
+		return false;
+	}
+
+	// Release any dirty neighbours from later stages that were only waiting on this region
+	void CompleteRegion(u32 regionIndex, u32 workerIndex, DirtyRect *regionDirtyRects)
+	{
+		u32 stageOrder = GetRegionStageOrder(regionIndex);
+
+		u32 neighbours[8];
+		u32 neighbourCount = GetNeighbourRegions(regionIndex, neighbours);
+		for(u32 neighbourNum = 0; neighbourNum < neighbourCount; ++neighbourNum)
+		{
+			u32 neighbourIndex = neighbours[neighbourNum];
+			if(IsInvalidDirtyRect(regionDirtyRects[neighbourIndex]) || GetRegionStageOrder(neighbourIndex) <= stageOrder)
+			{
+				continue;
+			}
+			if(m_regionDependencyCounts[neighbourIndex].fetch_sub(1) == 1)
+			{
+				m_regionQueues[workerIndex].Push(neighbourIndex);
+			}
+		}
+
+		m_regionsRemaining.fetch_sub(1);
+	}
+
+	struct UpdateJob
+	{
+		PixelSim *sim;
+		DirtyRect *regionDirtyRects;
+		bool evenFrame;
+	};
+
+	// Every worker drains its own queue, then steals from the others. Regions still waiting on
+	// neighbours will be pushed by whoever completes their last dependency, so keep looking until all are done
+	static void UpdateRegionsJob(void *userData, u32 workerIndex)
+	{
+		UpdateJob *job = (UpdateJob *)userData;
+		PixelSim *sim = job->sim;
+		WorkStealingDeque *ownQueue = &sim->m_regionQueues[workerIndex];
+
+		u32 regionIndex;
+		for(;;)
+		{
+			if(ownQueue->Pop(&regionIndex) || sim->StealRegion(workerIndex, &regionIndex))
+			{
+				sim->UpdateRegion(regionIndex, job->regionDirtyRects, job->evenFrame, workerIndex);
+				sim->CompleteRegion(regionIndex, workerIndex, job->regionDirtyRects);
+			}
+			else if(sim->m_regionsRemaining.load() == 0)
+			{
+				break;
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	void UpdateSim(float delta)
+	{
+		m_updateFrameNum++;
+		UpdateRandomFrameKeys();
+
+		if(m_updateEngine == UPDATE_ENGINE_MARGOLUS)
+		{
+			StepBlocks();
+		}
+		else
+		{
+			StepRegions();
+		}
+
+		SwapRegionDirtyRectBuffers();
+
+		if(m_hashVerification)
+		{
+			LogStateHash();
+		}
+	}
+
+	// One step of the scan engine
+	void StepRegions()
+	{
+		bool evenFrame = (m_updateFrameNum % 2) == 0;
+		m_startingStageNum = m_updateFrameNum % UPDATE_STAGE_COUNT;
+
+		DirtyRect *regionDirtyRects = m_regionDirtyRectBuffers[m_readRegionBufferIndex];
+
+		SnapshotRegionClassMasks();
+
+		// Instead of a barrier between each stage, a dirty region waits only on its dirty neighbours from
+		// earlier stages. Regions with nothing to wait on can start straight away
+		u32 activeCount = 0;
+		u32 readyCount = 0;
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
+		{
+			DirtyRect dirtyRect = regionDirtyRects[regionIndex];
+			if(IsInvalidDirtyRect(dirtyRect))
+			{
+				continue;
+			}
+			++activeCount;
+
+			u32 stageOrder = GetRegionStageOrder(regionIndex);
+
+			// The scan's padding reaches into neighbours, so their updated bits need to be clear as well
+			ClearRegionUpdatedBits(regionIndex);
+
+			u32 dependencyCount = 0;
+			u32 neighbours[8];
+			u32 neighbourCount = GetNeighbourRegions(regionIndex, neighbours);
+			for(u32 neighbourNum = 0; neighbourNum < neighbourCount; ++neighbourNum)
+			{
+				u32 neighbourIndex = neighbours[neighbourNum];
+				ClearRegionUpdatedBits(neighbourIndex);
+				if(!IsInvalidDirtyRect(regionDirtyRects[neighbourIndex]) && GetRegionStageOrder(neighbourIndex) < stageOrder)
+				{
+					++dependencyCount;
+				}
+			}
+			m_regionDependencyCounts[regionIndex].store(dependencyCount);
+
+			if(dependencyCount == 0)
+			{
+				RegionTask *task = &m_readyTasks[readyCount++];
+				task->regionIndex = regionIndex;
+				task->cost = GetRegionCost(dirtyRect);
+			}
+		}
 
-	void CreatePixel(Vector2 pos, PixelType type)
-	{
-		if(!InSimBounds(pos))
+		if(activeCount == 1)
 		{
-			return;
+			// Not worth waking the pool for
+			UpdateRegion(m_readyTasks[0].regionIndex, regionDirtyRects, evenFrame, 0);
+		}
+		else if(activeCount > 1)
+		{
+			SeedReadyQueues(readyCount);
+			m_regionsRemaining.store(activeCount);
+
+			UpdateJob job;
+			job.sim = this;
+			job.regionDirtyRects = regionDirtyRects;
+			job.evenFrame = evenFrame;
+
+			m_workerPool.Run(UpdateRegionsJob, &job);
 		}
 
-		PixelState *state = GetPixelStatePtr(pos);
-		if(state->type == PixelType::NONE)
+		if(activeCount > 0)
 		{
-			state->type = type;
+			MergeDirtyRectsJob mergeJob;
+			mergeJob.sim = this;
+			m_workerPool.Run(MergeWorkerDirtyRectsJob, &mergeJob);
+		}
 
-			Color color = GetTypeColor(type);
-			SetPixel(pos, color);
+		ApplyCrossRegionMoves();
+		MarkWrittenRegionColorsDirty();
+		DirtyRect *writeDirtyRects = m_regionDirtyRectBuffers[m_writeRegionBufferIndex];
 
-			AddToDirtyRect(pos);
+		m_awakeRegionCount = activeCount;
+		m_activeCellRegionCount = 0;
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
+		{
+			if(!IsInvalidDirtyRect(regionDirtyRects[regionIndex]))
+			{
+				m_activeCellRegionCount += m_regionActiveCellUpdates[regionIndex];
+			}
 		}
-		else if(type == PixelType::NONE) // If we are trying to create empty pixels. aka erase functionality
+		if(gRegionSleepSteps > 0)
 		{
-			ClearPixel(pos);
+			UpdateRegionSleep(regionDirtyRects, writeDirtyRects);
 		}
 	}
 
-	void CreatePixelsInSquare(Vector2 pos, u32 spawnCount, PixelType type)
+	// Anything a worker changed is covered by the merged dirty rects
+	void MarkWrittenRegionColorsDirty()
 	{
-		s32 halfSideLength = spawnCount / 2;
-
-		u32 pixelCount = spawnCount;
-		for(int pixelNum = 0; pixelNum < pixelCount; ++pixelNum)
+		DirtyRect *writeDirtyRects = m_regionDirtyRectBuffers[m_writeRegionBufferIndex];
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
 		{
-			int randX = GetRandomValue(-halfSideLength, halfSideLength);
-			int randY = GetRandomValue(-halfSideLength, halfSideLength);
-
-			Vector2 randomOffset = {};
-			randomOffset.x = randX;
-			randomOffset.y = randY;
-			Vector2 randomPos = Vector2Add(pos, randomOffset);
-			CreatePixel(randomPos, type);
+			m_regionColorsDirty[regionIndex] |= !IsInvalidDirtyRect(writeDirtyRects[regionIndex]);
 		}
 	}
 
-	void CreatePixelsInCircle(Vector2 pos, s32 radius, PixelType type)
+	// Origins of the blocks a region steps this step, inclusive and on the partition's offset. A region owns the blocks
+	// with their top left pixel inside it, as well as those reaching in from the border along the left and top of the sim,
+	// so its blocks can cover pixels of the neighbours to its right and below. Only blocks holding a pixel that changed in
+	// either of the last two steps are stepped: a block both partitions have left alone since will be left alone again
+	bool GetBlockUpdateBounds(u32 regionIndex, s32 partitionOffset, DirtyRect *outOrigins)
 	{
-		for(s32 y = -radius; y <= radius; y++)
+		s32 minX, maxX, minY, maxY;
+		GetRegionBounds(regionIndex, &minX, &maxX, &minY, &maxY);
+		s32 firstOriginX = (minX == 0) ? -1 : minX;
+		s32 firstOriginY = (minY == 0) ? -1 : minY;
+
+		// Pixels edited since the last step are already in the write buffer, so are picked up straight away
+		DirtyRect *regionDirtyRects = m_regionDirtyRectBuffers[m_readRegionBufferIndex];
+		DirtyRect *editDirtyRects = m_regionDirtyRectBuffers[m_writeRegionBufferIndex];
+		s32 colNum = regionIndex % m_regionColumns;
+		s32 rowNum = regionIndex / m_regionColumns;
+		DirtyRect changedRect = InvalidDirtyRect;
+		for(s32 rowOffset = 0; rowOffset <= 1; ++rowOffset)
 		{
-			for(s32 x = -radius; x <= radius; x++)
+			for(s32 colOffset = 0; colOffset <= 1; ++colOffset)
 			{
-				if((x * x) + (y * y) <= (radius * radius))
+				if((colNum + colOffset) >= (s32)m_regionColumns || (rowNum + rowOffset) >= (s32)m_regionRows)
+				{
+					continue;
+				}
+
+				u32 neighbourIndex = ((rowNum + rowOffset) * m_regionColumns) + colNum + colOffset;
+				DirtyRect changes[3] = {regionDirtyRects[neighbourIndex], m_prevDirtyRects[neighbourIndex], editDirtyRects[neighbourIndex]};
+				for(u32 changeNum = 0; changeNum < ArrayCount(changes); ++changeNum)
 				{
-					Vector2 pixelPos = {pos.x + x, pos.y + y};
-					CreatePixel(pixelPos, type);
+					DirtyRect rect = changes[changeNum];
+					if(IsInvalidDirtyRect(rect))
+					{
+						continue;
+					}
+					s32 rectMinX = MAX(rect.minX, firstOriginX);
+					s32 rectMaxX = MIN(rect.maxX, maxX + 1);
+					s32 rectMinY = MAX(rect.minY, firstOriginY);
+					s32 rectMaxY = MIN(rect.maxY, maxY + 1);
+					if(rectMinX <= rectMaxX && rectMinY <= rectMaxY)
+					{
+						ExpandDirtyRect(&changedRect, rectMinX, rectMaxX, rectMinY, rectMaxY);
+					}
 				}
 			}
 		}
-	}
+		if(IsInvalidDirtyRect(changedRect))
+		{
+			return false;
+		}
 
-	// For cases like gas when it leaves the area and we want it to disappear
-	void ClearPixel(Vector2 srcPos)
-	{
-		PixelState *srcState = GetPixelStatePtr(srcPos);
-		srcState->type = PixelType::NONE;
-		SetPixel(srcPos, BLANK);
-		AddToDirtyRect(srcPos);
+		// Blocks start a pixel before the pixels they cover. Origins all have the partition's parity
+		DirtyRect origins;
+		origins.minX = MAX(changedRect.minX - 1, firstOriginX);
+		origins.maxX = MIN(changedRect.maxX, maxX);
+		origins.minY = MAX(changedRect.minY - 1, firstOriginY);
+		origins.maxY = MIN(changedRect.maxY, maxY);
+		origins.minX += (origins.minX - partitionOffset) & 1;
+		origins.maxX -= (origins.maxX - partitionOffset) & 1;
+		origins.minY += (origins.minY - partitionOffset) & 1;
+		origins.maxY -= (origins.maxY - partitionOffset) & 1;
+
+		*outOrigins = origins;
+		bool result = (origins.minX <= origins.maxX) && (origins.minY <= origins.maxY);
+		return result;
 	}
 
-	void MovePixel(Vector2 srcPos, Vector2 destPos)
+	// Steps the blocks a region owns, from the bounds GetBlockUpdateBounds found
+	void UpdateRegionBlocks(u32 regionIndex, u32 workerIndex)
 	{
-		PixelState *srcState = GetPixelStatePtr(srcPos);
-		PixelState *destState = GetPixelStatePtr(destPos);
+		DirtyRect origins = m_blockUpdateRects[regionIndex];
 
-		destState->lastFrameUpdated = m_updateFrameNum;
-		destState->type = srcState->type;
-		srcState->type = PixelType::NONE;
+		// Blocks along a region's edges hold pixels of its neighbours, which other workers can be stepping blocks of at
+		// the same time. No region owns the pixels, so every count and changed cell is updated atomically
+		RegionUpdateContext context = {};
+		context.regionIndex = m_regionCount;
+		context.workerDirtyRects = m_workerDirtyRects[workerIndex];
 
-		// move pixel
-		Color sourceColor = GetPixel(srcPos);
-		SetPixel(srcPos, BLANK);
+		for(s32 y = origins.minY; y <= origins.maxY; y += 2)
+		{
+			// Random bits are looked up a pixel along, as blocks can start in the border
+			u32 randomWordIndex = U32_MAX;
+			u64 randomWord = 0;
 
-		SetPixel(destPos, sourceColor);
+			CellPos pos = GetCellPos(origins.minX, y);
+			for(s32 x = origins.minX; x <= origins.maxX; x += 2)
+			{
+				CellPos cells[BlockCellCount] = {pos, GetNeighbourCell(pos, 1, 0), GetNeighbourCell(pos, 0, 1), GetNeighbourCell(pos, 1, 1)};
+				pos = GetNeighbourCell(pos, 2, 0);
 
-		AddToDirtyRect(srcPos);
-		AddToDirtyRect(destPos);
-	}
+				PixelType types[BlockCellCount];
+				for(u32 cellNum = 0; cellNum < BlockCellCount; ++cellNum)
+				{
+					types[cellNum] = GetPixelType(cells[cellNum]);
+				}
+				u32 state = GetBlockState(types[0], types[1], types[2], types[3]);
 
-	void SwapPixels(Vector2 srcPos, Vector2 destPos)
-	{
-		PixelState *srcState = GetPixelStatePtr(srcPos);
-		PixelState *destState = GetPixelStatePtr(destPos);
+				u32 randomX = (u32)(x + 1);
+				if((randomX / 64) != randomWordIndex)
+				{
+					randomWordIndex = randomX / 64;
+					randomWord = GetRowRandomWord(randomWordIndex, (u32)(y + 1));
+				}
+				u32 mirrored = (u32)(randomWord >> (randomX % 64)) & 1;
 
-		PixelType destType = destState->type;
+				u8 moves = m_blockMoves[mirrored][state];
+				if(moves != IdentityBlockMoves)
+				{
+					ApplyBlockMoves(cells, types, moves, &context);
+				}
+			}
+		}
+	}
 
-		destState->lastFrameUpdated = m_updateFrameNum;
-		destState->type = srcState->type;
+	void ApplyBlockMoves(const CellPos *cells, const PixelType *types, u8 moves, RegionUpdateContext *context)
+	{
+		u8 colorVariants[BlockCellCount];
+		for(u32 cellNum = 0; cellNum < BlockCellCount; ++cellNum)
+		{
+			colorVariants[cellNum] = m_pixelColorVariants[cells[cellNum].index];
+		}
 
-		srcState->lastFrameUpdated = m_updateFrameNum;
-		srcState->type = destType;
+		// Material counts only change when the block straddles occupancy blocks, and so maybe regions.
+		// Otherwise the whole block is in one region, and its dirty area can be grown once
+		bool straddles = GetOccupancyBlockIndex(cells[0].x, cells[0].y) != GetOccupancyBlockIndex(cells[3].x, cells[3].y);
+		u32 regionIndex = GetRegionIndex(cells[0].x, cells[0].y);
+		for(u32 cellNum = 0; cellNum < BlockCellCount; ++cellNum)
+		{
+			u32 sourceNum = GetBlockMoveSource(moves, cellNum);
+			if(sourceNum == cellNum)
+			{
+				continue;
+			}
 
-		// move pixel
-		Color srcColor = GetPixel(srcPos);
-		Color destColor = GetPixel(destPos);
-		
-		SetPixel(srcPos, destColor);
-		SetPixel(destPos, srcColor);
+			CellPos pos = cells[cellNum];
+			m_pixelTypes[pos.index] = types[sourceNum];
+			m_pixelColorVariants[pos.index] = colorVariants[sourceNum];
+			if(straddles)
+			{
+				OnPixelTypeChanged(pos, types[cellNum], types[sourceNum], context);
+				AddToDirtyRect(pos.x, pos.y, context);
+			}
+			else if(gChangedCellCost > 0)
+			{
+				MarkCellChanged(regionIndex, pos.x, pos.y, context);
+			}
+		}
 
-		AddToDirtyRect(srcPos);
-		AddToDirtyRect(destPos);
+		if(!straddles)
+		{
+			ExpandDirtyRect(&context->workerDirtyRects[regionIndex], cells[0].x - 1, cells[3].x + 1, cells[0].y - 1, cells[3].y + 1);
+		}
 	}
 
-	struct MoveTestResult
+	struct BlockUpdateJob
 	{
-		Vector2 lastValidPos;
-		Vector2 colliderPos;
-		PixelType lastCollisionType;
-		bool hitBoundary;
+		PixelSim *sim;
 	};
 
-	bool PhysicsMoveTest(Vector2 srcPos, Vector2 destPos, u32 collideBitmask, bool stopAtBoundary, MoveTestResult *testResult)
+	// Blocks never share pixels, so every region can be stepped from the start and workers take them until none are left
+	static void UpdateBlocksJob(void *userData, u32 workerIndex)
 	{
-		Vector2 moveVec = Vector2Subtract(destPos, srcPos);
+		BlockUpdateJob *job = (BlockUpdateJob *)userData;
+		PixelSim *sim = job->sim;
+		WorkStealingDeque *ownQueue = &sim->m_regionQueues[workerIndex];
+
+		u32 regionIndex;
+		while(ownQueue->Pop(&regionIndex) || sim->StealRegion(workerIndex, &regionIndex))
+		{
+			sim->UpdateRegionBlocks(regionIndex, workerIndex);
+		}
+	}
 
-		float x = srcPos.x;
-		float y = srcPos.y;
+	// One step of the block engine, alternating between the two partitions of the sim into blocks.
+	// Settled regions aren't put to sleep, and there are no moves across regions to hold back
+	void StepBlocks()
+	{
+		s32 partitionOffset = (s32)(m_updateFrameNum % 2);
 
-		float stepX = moveVec.x < 0.0 ? -1.0 : 1.0;
-		float stepY = moveVec.y < 0.0 ? -1.0 : 1.0;
+		u32 taskCount = 0;
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
+		{
+			DirtyRect *origins = &m_blockUpdateRects[regionIndex];
+			if(GetBlockUpdateBounds(regionIndex, partitionOffset, origins))
+			{
+				RegionTask *task = &m_readyTasks[taskCount++];
+				task->regionIndex = regionIndex;
+				task->cost = (u32)(((origins->maxX - origins->minX) / 2) + 1) * (u32)(((origins->maxY - origins->minY) / 2) + 1);
+			}
+		}
 
-		float xLeft = floor(fabs(moveVec.x));
-		float yLeft = floor(fabs(moveVec.y));
+		// Bounds are found from the neighbours' rects as well, so these can only move on once every region has its own
+		DirtyRect *regionDirtyRects = m_regionDirtyRectBuffers[m_readRegionBufferIndex];
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
+		{
+			m_prevDirtyRects[regionIndex] = regionDirtyRects[regionIndex];
+		}
 
-		Vector2 testPos = srcPos;
+		if(taskCount == 1)
+		{
+			UpdateRegionBlocks(m_readyTasks[0].regionIndex, 0);
+		}
+		else if(taskCount > 1)
+		{
+			SeedReadyQueues(taskCount);
 
-		testResult->lastValidPos = srcPos;
-		testResult->colliderPos = Vector2Zero();
-		testResult->lastCollisionType = PixelType::NONE;
-		testResult->hitBoundary = false;
+			BlockUpdateJob job;
+			job.sim = this;
+			m_workerPool.Run(UpdateBlocksJob, &job);
+		}
 
-		while(!Vector2Equals(testPos, destPos))
+		if(taskCount > 0)
 		{
-			if(xLeft >= yLeft)
+			MergeDirtyRectsJob mergeJob;
+			mergeJob.sim = this;
+			m_workerPool.Run(MergeWorkerDirtyRectsJob, &mergeJob);
+		}
+		MarkWrittenRegionColorsDirty();
+
+		m_awakeRegionCount = taskCount;
+		m_activeCellRegionCount = 0;
+		m_sleepingRegionCount = 0;
+	}
+
+	// Where each moving class sits in a region, as a weighted sum of how many of its pixels are on each row.
+	// Pixels sliding sideways leave it the same, anything rising, falling, arriving or leaving changes it
+	u64 GetRegionMaterialSignature(u32 regionIndex)
+	{
+		s32 minX, maxX, minY, maxY;
+		GetRegionBounds(regionIndex, &minX, &maxX, &minY, &maxY);
+		u32 classMask = GetRegionClassMask(regionIndex);
+
+		u64 result = 0;
+		for(u32 classNum = 0; classNum < MovingClassCount; ++classNum)
+		{
+			if(!(classMask & (1u << classNum)))
 			{
-				xLeft -= 1;
-				x += stepX;
+				continue;
 			}
-			else
+			MaterialMask typeMask = GetMovementTypeMask((MovementClass)(MOVEMENT_POWDER + classNum));
+			for(s32 y = minY; y <= maxY; ++y)
 			{
-				yLeft -= 1;
-				y += stepY;
+				u32 rowCount = 0;
+				ForEachRowSpan(minX, maxX + 1, [&](s32 spanStart, u32 count) {
+					rowCount += CountSetBits64(GetSpanTypeBits(spanStart, y, count, typeMask));
+				});
+				result += rowCount * MixRandomBits(((u64)classNum << 32) | (u32)y);
 			}
-			testPos = {x, y};
+		}
+		return result;
+	}
+
+	// Regions updated this step that have gone long enough without a net material change are put to sleep, by dropping
+	// what they dirtied themselves. Any change to their pixels from a neighbour along their border or an edit wakes them
+	// for the next step, but they only stay awake if that changes their signature.
+	// Water settled across a few regions keeps trading pixels over their borders along its surface, changing the row
+	// counts of both sides. Signatures sum row counts with weights by row alone, so each row of regions, a band, also has
+	// the sum of its regions' signatures, which trades along the band leave the same. A region is also quiet when its
+	// band is, and wakes from its neighbours then don't keep it up.
+	// Pixels next to what was dropped can still be waiting to move, so it is set aside rather than lost. Neighbours
+	// narrowing their scans read its changed cells, and the region goes back over all of it once it wakes
+	void UpdateRegionSleep(DirtyRect *updatedDirtyRects, DirtyRect *nextDirtyRects)
+	{
+		m_sleepingRegionCount = 0;
+		for(u32 rowNum = 0; rowNum < m_regionRows; ++rowNum)
+		{
+			u32 firstRegionIndex = rowNum * m_regionColumns;
 
-			bool inBounds = InSimBounds(testPos);
-			if(stopAtBoundary && !inBounds)
+			// Regions neither updated nor changed by a neighbour hold what their signature was taken from
+			u64 bandSignature = 0;
+			for(u32 colNum = 0; colNum < m_regionColumns; ++colNum)
 			{
-				testResult->hitBoundary = true;
-				break;
+				u32 regionIndex = firstRegionIndex + colNum;
+				bool changed = !IsInvalidDirtyRect(updatedDirtyRects[regionIndex]) ||
+					m_regionWakeFlags[regionIndex].load(std::memory_order_relaxed);
+				m_bandRegionSignatures[colNum] = changed ? GetRegionMaterialSignature(regionIndex) : m_regionSignatures[regionIndex];
+				bandSignature += m_bandRegionSignatures[colNum];
 			}
-			if(inBounds)
+			bool bandQuiet = bandSignature == m_bandSignatures[rowNum];
+			m_bandSignatures[rowNum] = bandSignature;
+
+			for(u32 colNum = 0; colNum < m_regionColumns; ++colNum)
 			{
-				PixelState *testPosState = GetPixelStatePtr(testPos);
-				if((testPosState->type & collideBitmask) != 0)
+				u32 regionIndex = firstRegionIndex + colNum;
+				u8 wakeFlags = m_regionWakeFlags[regionIndex].load(std::memory_order_relaxed);
+				m_regionWakeFlags[regionIndex].store(0, std::memory_order_relaxed);
+				bool woken = (wakeFlags & REGION_WAKE_EDIT) || ((wakeFlags & REGION_WAKE_NEIGHBOUR) && !bandQuiet);
+
+				if(!IsInvalidDirtyRect(updatedDirtyRects[regionIndex]))
 				{
-					testResult->colliderPos = testPos;
-					testResult->lastCollisionType = testPosState->type;
+					u64 signature = m_bandRegionSignatures[colNum];
+					if(signature != m_regionSignatures[regionIndex] && !bandQuiet)
+					{
+						m_regionQuietSteps[regionIndex] = 0;
+					}
+					else if(m_regionQuietSteps[regionIndex] < gRegionSleepSteps)
+					{
+						++m_regionQuietSteps[regionIndex];
+					}
+					m_regionSignatures[regionIndex] = signature;
+
+					if(IsRegionAsleep(regionIndex) && !woken)
+					{
+						MoveRegionDirtyRect(nextDirtyRects, m_changedCellBuffers[m_writeRegionBufferIndex], m_sleepDirtyRects, m_sleepChangedCells, regionIndex);
+					}
 				}
-				if(testResult->lastCollisionType != PixelType::NONE)
+				if(!IsInvalidDirtyRect(nextDirtyRects[regionIndex]))
 				{
-					break;
+					MoveRegionDirtyRect(m_sleepDirtyRects, m_sleepChangedCells, nextDirtyRects, m_changedCellBuffers[m_writeRegionBufferIndex], regionIndex);
 				}
+				m_sleepingRegionCount += (IsRegionAsleep(regionIndex) && IsInvalidDirtyRect(nextDirtyRects[regionIndex])) ? 1 : 0;
 			}
-			testResult->lastValidPos = testPos;
 		}
+	}
 
-		bool canMove = !Vector2Equals(srcPos, testResult->lastValidPos);
-		return canMove;
+	inline bool IsRegionAsleep(u32 regionIndex)
+	{
+		return m_regionQuietSteps[regionIndex] >= gRegionSleepSteps && gRegionSleepSteps > 0;
 	}
 
-	bool UpdateSand(Vector2 pos)
+	// Regions updated by the last step, and regions asleep after it
+	inline u32 GetAwakeRegionCount()
 	{
-		bool stopAtBoundary = true;
-		u32 collideBitmask = PixelType::SAND | PixelType::STONE;
-		s32 velocity = 1;
-		s32 xDelta = (rand() % 2) == 0 ? velocity : -velocity;
+		return m_awakeRegionCount;
+	}
 
-		Vector2 movePositions[] = {
-			{pos.x, pos.y + velocity}, // Down
-			{pos.x + xDelta, pos.y + velocity}, // DownLeft or DownRight
-			{pos.x - xDelta, pos.y + velocity}, // Opposite of above
-		};
-		u8 movePositionCount = ArrayCount(movePositions);
+	inline u32 GetSleepingRegionCount()
+	{
+		return m_sleepingRegionCount;
+	}
 
-		for(u8 posNum = 0; posNum < movePositionCount; ++posNum)
-		{
-			Vector2 testPos = movePositions[posNum];
+	// Regions the last step updated from their active cells rather than by scanning
+	inline u32 GetActiveCellRegionCount()
+	{
+		return m_activeCellRegionCount;
+	}
+
+	inline u32 GetRegionCount()
+	{
+		return m_regionCount;
+	}
 
-			bool inBounds = InSimBounds(testPos);
-			if(inBounds)
+	// Materials anywhere in a region, as a bit per material
+	MaterialMask GetRegionMaterialMask(u32 regionIndex)
+	{
+		MaterialMask result = {};
+		for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+		{
+			if(m_regionMaterialCounts[regionIndex].counts[typeNum].load(std::memory_order_relaxed) > 0)
 			{
-				PixelState *testPosState = GetPixelStatePtr(testPos);
-				if((testPosState->type & collideBitmask) == 0)
-				{
-					if(testPosState->type == PixelType::WATER)
-					{
-						SwapPixels(pos, testPos);
-					}
-					else
-					{
-						MovePixel(pos, testPos);
-					}
-					return true;
-				}
+				result |= GetMaterialBit(typeNum);
 			}
 		}
-
-		return false;
+		return result;
 	}
 
-	bool UpdateWater(Vector2 pos)
-	{	
-		bool stopAtBoundary = true;
-		u32 collideBitmask = PixelType::SAND | PixelType::WATER | PixelType::STONE;
-		s32 velocity = 5;
-		s32 xDelta = (rand() % 2) == 0 ? velocity : -velocity;
-
-		Vector2 movePositions[] = {
-			{pos.x, pos.y + velocity}, // Down
-			{pos.x + xDelta, pos.y + velocity}, // DownLeft or DownRight
-			{pos.x - xDelta, pos.y + velocity}, // Opposite of above
-			{pos.x + xDelta, pos.y}, // Left or right
-			{pos.x - xDelta, pos.y}, // Oppisite of above
-		};
-		u8 movePositionCount = ArrayCount(movePositions);
-
-		for(u8 posNum = 0; posNum < movePositionCount; ++posNum)
+	// Materials anywhere in the sim, the top of the occupancy pyramid
+	MaterialMask GetWorldMaterialMask()
+	{
+		MaterialMask result = {};
+		for(u32 regionIndex = 0; regionIndex < m_regionCount; ++regionIndex)
 		{
-			Vector2 testPos = movePositions[posNum];
+			result |= GetRegionMaterialMask(regionIndex);
+		}
+		return result;
+	}
 
-			MoveTestResult moveResult;
-			if(PhysicsMoveTest(pos, testPos, collideBitmask, stopAtBoundary, &moveResult))
+	// Which of the materials in searchMask are within the pixels [startX, endX) x [startY, endY). Regions and blocks
+	// the area covers whole are answered from their counts, and any that can't add a material still being searched
+	// for are skipped, so pixels are only read in the blocks along the area's edges. Empty pixels are never reported
+	MaterialMask GetAreaMaterialMask(s32 startX, s32 endX, s32 startY, s32 endY, MaterialMask searchMask = AnyMaterialMask)
+	{
+		startX = MAX(startX, 0);
+		endX = MIN(endX, (s32)m_simWidth);
+		startY = MAX(startY, 0);
+		endY = MIN(endY, (s32)m_simHeight);
+
+		MaterialMask result = {};
+		searchMask &= AnyMaterialMask;
+		for(s32 regionY = startY & ~(s32)m_layout.tileMask; regionY < endY; regionY += m_regionPixelSize)
+		{
+			for(s32 regionX = startX & ~(s32)m_layout.tileMask; regionX < endX; regionX += m_regionPixelSize)
 			{
-				MovePixel(pos, moveResult.lastValidPos);
-				return true;
+				MaterialMask remainingMask = searchMask & ~result;
+				MaterialMask regionMask = GetRegionMaterialMask(GetRegionIndex(regionX, regionY)) & remainingMask;
+				if(IsMaterialMaskEmpty(regionMask))
+				{
+					continue;
+				}
+
+				s32 minX = MAX(startX, regionX);
+				s32 maxX = MIN(endX, regionX + (s32)m_regionPixelSize);
+				s32 minY = MAX(startY, regionY);
+				s32 maxY = MIN(endY, regionY + (s32)m_regionPixelSize);
+				bool wholeRegion = minX == regionX && maxX == MIN(regionX + (s32)m_regionPixelSize, (s32)m_simWidth) &&
+					minY == regionY && maxY == MIN(regionY + (s32)m_regionPixelSize, (s32)m_simHeight);
+				result |= wholeRegion ? regionMask : GetBlocksMaterialMask(minX, maxX, minY, maxY, remainingMask);
 			}
 		}
-
-		return false;
+		return result;
 	}
 
-	bool UpdateGas(Vector2 pos)
+	inline bool AreaHasMaterial(s32 startX, s32 endX, s32 startY, s32 endY, PixelType type)
 	{
-		bool stopAtBoundary = false;
-		u32 collideBitmask = PixelType::SAND | PixelType::WATER | PixelType::GAS | PixelType::STONE; 
-		s32 velocity = 1;
-		s32 xDelta = (rand() % 2) == 0 ? velocity : -velocity;
+		return !IsMaterialMaskEmpty(GetAreaMaterialMask(startX, endX, startY, endY, GetMaterialBit(type)));
+	}
 
-		Vector2 movePositions[] = {
-			{pos.x, pos.y - velocity}, // Up
-			{pos.x + xDelta, pos.y - velocity}, // UpLeft or UpRight
-			{pos.x - xDelta, pos.y - velocity}, // Opposite of above
-			{pos.x + xDelta, pos.y}, // Left or right
-			{pos.x - xDelta, pos.y}, // Oppisite of above
-		};
-		u8 movePositionCount = ArrayCount(movePositions);
-		
-		for(u8 posNum = 0; posNum < movePositionCount; ++posNum)
+	// The block level of GetAreaMaterialMask, for an area within the sim
+	MaterialMask GetBlocksMaterialMask(s32 startX, s32 endX, s32 startY, s32 endY, MaterialMask searchMask)
+	{
+		MaterialMask result = {};
+		for(s32 blockY = startY & ~(s32)(OccupancyBlockSize - 1); blockY < endY; blockY += OccupancyBlockSize)
 		{
-			Vector2 testPos = movePositions[posNum];
-
-			MoveTestResult moveResult;
-			if(PhysicsMoveTest(pos, testPos, collideBitmask, stopAtBoundary, &moveResult))
+			for(s32 blockX = startX & ~(s32)(OccupancyBlockSize - 1); blockX < endX; blockX += OccupancyBlockSize)
 			{
-				if(InSimBounds(moveResult.lastValidPos))
+				MaterialMask remainingMask = searchMask & ~result;
+				MaterialMask blockMask = GetBlockMaterialMask(m_blockMaterialCounts[GetOccupancyBlockIndex(blockX, blockY)]) & remainingMask;
+				if(IsMaterialMaskEmpty(blockMask))
 				{
-					MovePixel(pos, moveResult.lastValidPos);
+					continue;
 				}
-				else
+
+				s32 minX = MAX(startX, blockX);
+				s32 maxX = MIN(endX, blockX + (s32)OccupancyBlockSize);
+				s32 minY = MAX(startY, blockY);
+				s32 maxY = MIN(endY, blockY + (s32)OccupancyBlockSize);
+				if(minX == blockX && maxX == (blockX + (s32)OccupancyBlockSize) && minY == blockY && maxY == (blockY + (s32)OccupancyBlockSize))
+				{
+					result |= blockMask;
+					continue;
+				}
+
+				// Blocks on the sim's right and bottom edges are never whole, but only hold pixels within the sim
+				for(s32 y = minY; y < maxY; ++y)
 				{
-					ClearPixel(pos);
+					for(s32 x = minX; x < maxX; ++x)
+					{
+						result |= GetMaterialBit(GetPixelType(x, y)) & blockMask;
+					}
 				}
-				return true;
 			}
 		}
+		return result;
+	}
 
-		return false;
+	// Deterministic mode gives bit identical results at any thread count. Random values are already a pure
+	// function of seed and pixel position, and a region only ever runs after its earlier stage neighbours
+	// regardless of which worker picks it up, and the constructor makes sure two regions running at once can never
+	// reach the same pixel. What is left is applying cross region moves in a canonical order
+	void SetDeterministic(bool deterministic)
+	{
+		m_deterministic = deterministic;
 	}
 
-	void UpdateSim(float delta)
+	inline bool IsDeterministic()
 	{
-		m_updateFrameNum++;
+		return m_deterministic;
+	}
 
-		bool evenFrame = (m_updateFrameNum % 2) == 0;
-		u32 startingStageNum = m_updateFrameNum % UPDATE_STAGE_COUNT;
+	// Switching engines marks the whole sim as changed, as what one engine leaves settled the other may still move.
+	// With too many materials for the block engine's table the sim stays on the scan
+	void SetUpdateEngine(UpdateEngine engine)
+	{
+		Assert(engine < UPDATE_ENGINE_COUNT);
+		if(!BlockEngineAvailable)
+		{
+			engine = UPDATE_ENGINE_SCAN;
+		}
+		if(engine != m_updateEngine)
+		{
+			m_updateEngine = engine;
+			MarkSimChanged();
+		}
+	}
 
-		DirtyRect *regionDirtyRects = m_regionDirtyRectBuffers[m_readRegionBufferIndex];
+	inline UpdateEngine GetUpdateEngine()
+	{
+		return m_updateEngine;
+	}
 
-		for(u32 stageNum = 0; stageNum < UPDATE_STAGE_COUNT; ++stageNum)
+	// Marks every pixel as changed and wakes every region, for when which pixels can move is no longer known
+	void MarkSimChanged()
+	{
+		for(s32 y = 0; y < (s32)m_simHeight; ++y)
 		{
-			SimUpdateStage *stage = &m_stages[(startingStageNum + stageNum) % UPDATE_STAGE_COUNT];
-			for(u32 regionNum = 0; regionNum < stage->regionIndexCount; ++regionNum)
+			for(s32 x = 0; x < (s32)m_simWidth; ++x)
 			{
-				u32 regionIndex = stage->regionIndicesToUpdate[regionNum];
-
-				DirtyRect dirtyRect = regionDirtyRects[regionIndex];
+				AddToDirtyRect(x, y);
+			}
+		}
+		memset(m_regionQuietSteps, 0, m_regionCount * sizeof(u32));
+	}
 
-				if(IsInvalidDirtyRect(dirtyRect))
-				{
-					continue;
-				}
+	// When enabled, a hash of every pixel state is logged after each update, to compare runs against each other
+	void SetHashVerification(bool enabled)
+	{
+		m_hashVerification = enabled;
+	}
 
-				s32 startX = Clamp(dirtyRect.minX - 1, 0, m_simWidth);
-				s32 endX = Clamp(dirtyRect.maxX + 1, 0, m_simWidth);
-				s32 startY = Clamp(dirtyRect.minY - 1, 0, m_simHeight);
-				s32 endY = Clamp(dirtyRect.maxY + 1, 0, m_simHeight);
+	// When enabled, regions always scan their whole dirty rect rather than narrowing to their active cells. The results
+	// are the same either way, this is just slower, as a reference to check that against
+	void SetFullRectScans(bool enabled)
+	{
+		m_fullRectScans = enabled;
+	}
 
-				for(s32 y = (endY - 1); y >= startY; --y)
-				{
-					for(s32 x = evenFrame ? (endX - 1) : startX; evenFrame ? x >= startX : x < endX; evenFrame ? --x : ++x)
-					{
-						Vector2 pos = {x, y};
+	// Picks the kernel for regions holding only powder. The bit sliced one steps the sim the same as the per pixel scan
+	void SetBitSlicedPowder(bool enabled)
+	{
+		constexpr u32 PowderMask = GetMovingClassBit(MOVEMENT_POWDER);
+		if(enabled)
+		{
+			m_regionKernels[PowderMask][0] = &PixelSim::UpdateRegionPowderBits<false>;
+			m_regionKernels[PowderMask][1] = &PixelSim::UpdateRegionPowderBits<true>;
+		}
+		else
+		{
+			m_regionKernels[PowderMask][0] = &PixelSim::UpdateRegionPixels<PowderMask, false>;
+			m_regionKernels[PowderMask][1] = &PixelSim::UpdateRegionPixels<PowderMask, true>;
+		}
+	}
 
-						bool moved = false;
+	void LogStateHash()
+	{
+		if(m_stateHashCount == m_stateHashCapacity)
+		{
+			m_stateHashCapacity = MAX(m_stateHashCapacity * 2, 1024);
+			m_stateHashes = (u32 *)realloc(m_stateHashes, m_stateHashCapacity * sizeof(u32));
+		}
+		// Update bookkeeping is left out, it only has to agree within a frame
+		u32 stateHash = HashMemory(m_pixelTypes, m_cellTotal * sizeof(PixelType));
+		stateHash ^= HashMemory(m_pixelColorVariants, m_cellTotal * sizeof(u8)) * 31;
+		m_stateHashes[m_stateHashCount++] = stateHash;
+	}
 
-						PixelState *state = GetPixelStatePtr(pos);
+	inline u32 GetStateHashCount()
+	{
+		return m_stateHashCount;
+	}
 
-						if(state->lastFrameUpdated != m_updateFrameNum)
-						{
-							switch(state->type)
-							{
-							case PixelType::SAND: { moved = UpdateSand(pos); } break;
-							case PixelType::WATER: { moved = UpdateWater(pos); } break;
-							case PixelType::GAS: {moved = UpdateGas(pos); } break;
-							}
-						}
-					}
-				}
-			}
-		}
+	inline u32 *GetStateHashes()
+	{
+		return m_stateHashes;
+	}
 
-		SwapRegionDirtyRectBuffers();
+	inline u32 GetLastStateHash()
+	{
+		u32 result = (m_stateHashCount > 0) ? m_stateHashes[m_stateHashCount - 1] : 0;
+		return result;
 	}
 	
 	void DebugDrawRegions(bool drawActiveRegions, bool drawDirtyRects, bool drawRegionNumbers)
@@ -693,7 +3302,7 @@ public:
 						if(IsInvalidDirtyRect(regionDirtyRect))
 						{
 							u32 regionSreenSize = m_regionPixelSize * m_simPixelScale;
-							DrawRectangleLines(screenX, screenY, regionSreenSize, regionSreenSize, DARKGRAY);
+							DrawRectangleLines(screenX, screenY, regionSreenSize, regionSreenSize, IsRegionAsleep(regionIndex) ? DARKBLUE : DARKGRAY);
 						}
 					}
 				}
@@ -730,15 +3339,52 @@ public:
 	}
 
 private:
-	PixelState *m_pixelStates;
+	PixelLayout m_layout;
+	u32 m_cellTotal; // Pixels in the tiled planes, including the padding of edge tiles
+
+	u8 *m_pixelTypeMemory;
+	PixelType *m_pixelTypes;
+	u8 *m_pixelColorVariants;
+
 	Color *m_pixelBuffer;
+	Color m_variantColors[ColorPaletteSize]; // Padded out for the color expansion kernels
+	u8 *m_regionColorsDirty;
+
+	u64 *m_regionSignatures; // From GetRegionMaterialSignature, as of the region's last update
+	u32 *m_regionQuietSteps; // Steps updated without a change to the signature or the band's, up to gRegionSleepSteps
+	u64 *m_bandSignatures; // Sums of the signatures of each row of regions, see UpdateRegionSleep
+	u64 *m_bandRegionSignatures; // Current signatures of the regions of the band being put to sleep
+	std::atomic<u8> *m_regionWakeFlags; // Pixels changed by something other than the region's own update
+	u32 m_awakeRegionCount;
+	u32 m_sleepingRegionCount;
 
 	DirtyRect *m_regionDirtyRectBuffers[DirtyRectBufferCount];
+	u8 *m_changedCellMemory[DirtyRectBufferCount];
+	u64 *m_changedCellBuffers[DirtyRectBufferCount]; // See MarkCellChanged
+	u32 m_changedCellRowCount;
+	u32 m_changedCellRowWords;
+	u32 m_regionChangedCellStride; // In words
+	DirtyRect *m_sleepDirtyRects; // Dropped by regions going to sleep, see UpdateRegionSleep
+	u8 *m_sleepChangedCellMemory;
+	u64 *m_sleepChangedCells;
+	u8 *m_regionActiveCellUpdates; // Set for regions updated from their active cells
+	u32 m_activeCellRegionCount;
 	u8 m_readRegionBufferIndex;
 	u8 m_writeRegionBufferIndex;
 
 	u32 m_updateFrameNum;
 
+	bool m_deterministic;
+	bool m_hashVerification;
+	bool m_fullRectScans;
+	u32 *m_stateHashes;
+	u32 m_stateHashCount;
+	u32 m_stateHashCapacity;
+
+	u64 m_randomSeed;
+	u64 m_randomFrameKeys[RANDOM_STREAM_COUNT];
+	u32 m_startingStageNum;
+
 	u32 m_simPixelScale;
 	u32 m_simWidth;
 	u32 m_simHeight;
@@ -749,16 +3395,60 @@ private:
 	u32 m_regionCount;
 	u32 m_regionPixelSize;
 
-	SimUpdateStage m_stages[UPDATE_STAGE_COUNT];
+	RegionMaterialCounts *m_regionMaterialCounts;
+	BlockMaterialCounts *m_blockMaterialCounts; // See GetBlockCountUnit
+	u32 m_blockColumns;
+	u32 m_blockRows;
+	u8 *m_regionClassMasks;
+	RegionKernel m_regionKernels[MovingClassMaskCount][2]; // [classMask][reverse]
+
+	u8 *m_regionUpdatedMemory;
+	u64 *m_regionUpdatedBits;
+	u32 m_regionUpdatedStride;
+	u32 m_updatedRowWords;
+	u32 *m_regionUpdatedClearFrames;
+
+	u8 *m_regionStageNums;
+	std::atomic<u32> *m_regionDependencyCounts;
+	std::atomic<u32> m_regionsRemaining;
+
+	WorkerPool m_workerPool;
+	WorkStealingDeque *m_regionQueues;
+	RegionTask *m_readyTasks;
+	u64 *m_queueCosts;
+
+	u8 *m_workerDirtyRectMemory;
+	DirtyRect **m_workerDirtyRects;
+	u32 m_workerDirtyRectStride;
+
+	CrossRegionMoveQueue *m_outboundMoveQueues;
+	CrossRegionMove *m_sortedMoves;
+	u32 m_sortedMoveCapacity;
+
+	UpdateEngine m_updateEngine;
+	u8 (*m_blockMoves)[BlockStateCount]; // [mirrored][state], see GetBlockMoves. Null when the engine isn't available
+	DirtyRect *m_prevDirtyRects; // What each region's read buffer held for the last block step
+	DirtyRect *m_blockUpdateRects; // Origins of the blocks each region steps, see GetBlockUpdateBounds
 };
 
 #include "time.h"
+#include "simTests.h"
 
-int main()
+int main(int argc, char **argv)
 {
+	if(argc > 1 && strcmp(argv[1], "--test") == 0)
+	{
+		return RunSimTests();
+	}
+
 	SetRandomSeed(time(0));
 
 	SetConfigFlags(FLAG_MSAA_4X_HINT);
+
+	if(gForceScalarKernels)
+	{
+		SelectSimdKernels(CPU_LEVEL_SCALAR);
+	}
 	
 	GameData gameData = {};
 
@@ -777,7 +3467,10 @@ int main()
 
 	Texture2D screenTexture = LoadTextureFromImage(blankImage);
 
-	PixelSim pixelSim(simWidth, simHeight, SimPixelScale, gRegionSize);
+	PixelSim pixelSim(simWidth, simHeight, SimPixelScale, gRegionSize, gSimThreadCount);
+	pixelSim.SetRandomSeed((u64)time(0));
+	pixelSim.SetDeterministic(gSimDeterministic);
+	pixelSim.SetHashVerification(gSimDeterministic);
 
 	float lastFrameTime = GetFrameTime();
 	
@@ -849,6 +3542,14 @@ int main()
 		if(IsKeyPressed(KEY_F5)) { debugKey5Toggle = !debugKey5Toggle; }
 		if(IsKeyPressed(KEY_F6)) { debugKey6Toggle = !debugKey6Toggle; }
 		if(IsKeyPressed(KEY_F7)) { debugKey7Toggle = !debugKey7Toggle; }
+		if(IsKeyPressed(KEY_F8))
+		{
+			SelectSimdKernels((GetSimdKernelLevel() == CPU_LEVEL_SCALAR) ? GetCpuFeatureLevel() : CPU_LEVEL_SCALAR);
+		}
+		if(IsKeyPressed(KEY_F9))
+		{
+			pixelSim.SetUpdateEngine((UpdateEngine)((pixelSim.GetUpdateEngine() + 1) % UPDATE_ENGINE_COUNT));
+		}
 
 		simTimeAccumulator += frameTimeDelta;
 		if (simTimeAccumulator > simStepTime)
@@ -857,7 +3558,7 @@ int main()
 			pixelSim.UpdateSim(simStepTime);
 		}
 
-		Color *pixelBuffer = pixelSim.GetPixelBuffer();
+		Color *pixelBuffer = pixelSim.UpdatePixelBuffer();
 		Rectangle simUpdateRect = pixelSim.GetSimSize();
 		UpdateTextureRec(screenTexture, simUpdateRect, pixelBuffer);
 
@@ -889,6 +3590,34 @@ int main()
 		sprintf_s(textBuffer, TextBufferSize, "Spawn amount - %u", spawnPixelCount);
 		DrawText(textBuffer, 10, 60, debugFontSize, debugTextColor);
 
+		sprintf_s(textBuffer, TextBufferSize, "Engine - %s, kernels - %s", UpdateEngineToString(pixelSim.GetUpdateEngine()),
+			CpuFeatureLevelToString(GetSimdKernelLevel()));
+		DrawText(textBuffer, 10, 80, debugFontSize, debugTextColor);
+
+		sprintf_s(textBuffer, TextBufferSize, "Regions - %u awake (%u by active cells), %u asleep of %u",
+			pixelSim.GetAwakeRegionCount(), pixelSim.GetActiveCellRegionCount(), pixelSim.GetSleepingRegionCount(), pixelSim.GetRegionCount());
+		DrawText(textBuffer, 10, 100, debugFontSize, debugTextColor);
+
+		// Answered from the occupancy counts, so only the pixels around the edge of the brush are read
+		s32 brushRadius = (s32)spawnPixelCount;
+		MaterialMask brushMaterials = pixelSim.GetAreaMaterialMask((s32)mouseSimPos.x - brushRadius, (s32)mouseSimPos.x + brushRadius + 1,
+			(s32)mouseSimPos.y - brushRadius, (s32)mouseSimPos.y + brushRadius + 1);
+		int textLength = sprintf_s(textBuffer, TextBufferSize, "Under brush -");
+		for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+		{
+			if(HasMaterial(brushMaterials, typeNum))
+			{
+				textLength += sprintf_s(textBuffer + textLength, TextBufferSize - textLength, " %s", PixelTypeToString((PixelType)typeNum));
+			}
+		}
+		DrawText(textBuffer, 10, 120, debugFontSize, debugTextColor);
+
+		if(pixelSim.GetStateHashCount() > 0)
+		{
+			sprintf_s(textBuffer, TextBufferSize, "State hash - %08x (%u)", pixelSim.GetLastStateHash(), pixelSim.GetStateHashCount());
+			DrawText(textBuffer, 10, 140, debugFontSize, debugTextColor);
+		}
+
 		EndDrawing();
 
 		
@@ -0,0 +1,134 @@
+#pragma once
+
+// A second way of stepping the sim, as a block cellular automaton over the Margolus neighbourhood. The sim is split
+// into 2x2 blocks, offset by a pixel in both directions every other step, and each block's next state is looked up
+// from its current one. Blocks never share pixels, so they can be stepped in any order, or all at once, with the same result
+
+enum UpdateEngine : u8
+{
+	UPDATE_ENGINE_SCAN, // Regions scanned a pixel at a time, moving pixels in place
+	UPDATE_ENGINE_MARGOLUS, // 2x2 blocks stepped from a lookup table
+
+	UPDATE_ENGINE_COUNT
+};
+
+inline const char *UpdateEngineToString(UpdateEngine engine)
+{
+	constexpr const char *EngineNames[UPDATE_ENGINE_COUNT] = {"Scan", "Margolus"};
+	Assert(engine < UPDATE_ENGINE_COUNT);
+	return EngineNames[engine];
+}
+
+// Cells of a block are numbered row major from the top left. A block's state packs the types of its cells together,
+// in as few bits per cell as hold every material id
+constexpr u32 GetBlockCellTypeBits()
+{
+	u32 result = 1;
+	while((1u << result) < MaterialCount)
+	{
+		++result;
+	}
+	return result;
+}
+
+constexpr u32 BlockCellCount = 4;
+constexpr u32 BlockCellTypeBits = GetBlockCellTypeBits();
+
+// The move table has an entry per state, so grows sixteen times over with each bit a cell needs. Past 16 bits of
+// state, more than 16 materials, the table would outgrow the caches, so the block engine isn't offered and the sim
+// always scans
+constexpr u32 MaxBlockStateBits = 16;
+constexpr bool BlockEngineAvailable = (BlockCellCount * BlockCellTypeBits) <= MaxBlockStateBits;
+constexpr u32 BlockStateCount = BlockEngineAvailable ? (1u << (BlockCellCount * BlockCellTypeBits)) : 1;
+
+inline u32 GetBlockState(PixelType topLeft, PixelType topRight, PixelType bottomLeft, PixelType bottomRight)
+{
+	u32 result = topLeft | (topRight << BlockCellTypeBits) | (bottomLeft << (2 * BlockCellTypeBits)) |
+		(bottomRight << (3 * BlockCellTypeBits));
+	return result;
+}
+
+// What happens to a block is the cell each of its cells takes its pixel from, two bits per cell
+constexpr u8 IdentityBlockMoves = 0xe4;
+
+inline u32 GetBlockMoveSource(u8 moves, u32 cellNum)
+{
+	return (moves >> (cellNum * 2)) & 3;
+}
+
+// Each pixel tries the moves of its movement pattern in order, as the scan does, but only a pixel long and only within
+// the block. Cells go top row first, from the left, with everything mirrored when mirrored is set. A pixel moves at most
+// once, and so does whatever it trades places with. Moves are always swaps, so pixels are never created or destroyed:
+// powder falling into gas pushes it up rather than crushing it, and gas stops at the edge of the sim instead of leaving
+inline u8 GetBlockMoves(u32 state, bool mirrored)
+{
+	PixelType types[BlockCellCount];
+	u32 sources[BlockCellCount];
+	for(u32 cellNum = 0; cellNum < BlockCellCount; ++cellNum)
+	{
+		types[cellNum] = (PixelType)((state >> (cellNum * BlockCellTypeBits)) & ((1 << BlockCellTypeBits) - 1));
+		sources[cellNum] = cellNum;
+	}
+
+	u32 movedMask = 0;
+	for(u32 orderNum = 0; orderNum < BlockCellCount; ++orderNum)
+	{
+		u32 cellNum = mirrored ? (orderNum ^ 1) : orderNum;
+		if((movedMask >> cellNum) & 1)
+		{
+			continue;
+		}
+
+		PixelType type = types[cellNum];
+		const MovementPattern *pattern = &gMovementPatterns[gMaterialLookup.movement[type]];
+		for(u32 moveNum = 0; moveNum < pattern->moveCount; ++moveNum)
+		{
+			s32 xOffset = mirrored ? -pattern->moves[moveNum][0] : pattern->moves[moveNum][0];
+			s32 destX = (s32)(cellNum & 1) + xOffset;
+			s32 destY = (s32)(cellNum >> 1) + pattern->moves[moveNum][1];
+			if((u32)destX > 1 || (u32)destY > 1)
+			{
+				continue;
+			}
+
+			u32 destNum = ((u32)destY * 2) + (u32)destX;
+			Interaction interaction = gMaterialLookup.interactions[type][types[destNum]];
+			if(((movedMask >> destNum) & 1) || (interaction != INTERACTION_MOVE && interaction != INTERACTION_SWAP))
+			{
+				continue;
+			}
+
+			types[cellNum] = types[destNum];
+			types[destNum] = type;
+			u32 source = sources[cellNum];
+			sources[cellNum] = sources[destNum];
+			sources[destNum] = source;
+			movedMask |= (1u << cellNum) | (1u << destNum);
+			break;
+		}
+	}
+
+	u8 result = 0;
+	for(u32 cellNum = 0; cellNum < BlockCellCount; ++cellNum)
+	{
+		result |= (u8)(sources[cellNum] << (cellNum * 2));
+	}
+	return result;
+}
+
+// Moves for every block state, unmirrored then mirrored. States holding types past the last material never come up
+inline void BuildBlockMoveTable(u8 (*outMoves)[BlockStateCount])
+{
+	for(u32 mirrorNum = 0; mirrorNum < 2; ++mirrorNum)
+	{
+		for(u32 state = 0; state < BlockStateCount; ++state)
+		{
+			bool validState = true;
+			for(u32 cellNum = 0; cellNum < BlockCellCount; ++cellNum)
+			{
+				validState = validState && (((state >> (cellNum * BlockCellTypeBits)) & ((1 << BlockCellTypeBits) - 1)) < MaterialCount);
+			}
+			outMoves[mirrorNum][state] = validState ? GetBlockMoves(state, mirrorNum == 1) : IdentityBlockMoves;
+		}
+	}
+}
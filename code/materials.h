@@ -0,0 +1,410 @@
+#pragma once
+
+// Every material the sim knows about, described as data. The tables below are built at compile time into
+// flat lookups indexed by material id, so the update has one generic kernel rather than a case per material
+
+// Material ids, stored as a single byte per pixel. They index gMaterialDefs, so keep the two in the same order.
+// Materials that never move come first, so a single compare against FirstMovingType tells if a pixel can move
+enum PixelType : u8
+{
+	NONE = 0,
+	STONE,
+	BOUNDARY, // Fills the ghost border around the sim, never drawn or placed
+	SAND,
+	WATER,
+	GAS,
+
+	PIXEL_TYPE_COUNT
+};
+
+enum MovementClass : u8
+{
+	MOVEMENT_EMPTY,
+	MOVEMENT_STATIC, // Never moves, blocks everything
+	MOVEMENT_BOUNDARY, // Edge of the sim. Blocks everything except gas, which disappears into it
+	MOVEMENT_POWDER, // Falls straight down, then diagonally
+	MOVEMENT_LIQUID, // Falls like a powder, then spreads sideways
+	MOVEMENT_GAS, // Rises, then spreads sideways
+
+	MOVEMENT_CLASS_COUNT
+};
+
+// What happens when a moving pixel tries to enter a pixel of another material
+enum Interaction : u8
+{
+	INTERACTION_BLOCK, // Stops before the target
+	INTERACTION_MOVE, // Takes the target's place, which is empty or gets pushed out of the sim
+	INTERACTION_SWAP, // Trades places with the target
+	INTERACTION_SINK, // Removed from the sim
+};
+
+// Pixels store an index into their material's palette rather than a color
+constexpr u32 MaxColorVariants = 4;
+
+struct MaterialDef
+{
+	const char *name;
+	MovementClass movement;
+	u8 density; // Heavier materials sink through lighter liquids
+	u8 maxVelocity; // Pixels moved per step, no more than the ghost border
+	u8 colorCount;
+	u32 colors[MaxColorVariants];
+};
+
+constexpr MaterialDef gMaterialDefs[] = {
+	{"None", MOVEMENT_EMPTY, 0, 0, 1, {0x00000000}},
+	{"Stone", MOVEMENT_STATIC, 255, 0, 3, {0x333941ff, 0x4a5462ff, 0x6d758dff}},
+	{"Boundary", MOVEMENT_BOUNDARY, 255, 0, 1, {0x00000000}},
+	{"Sand", MOVEMENT_POWDER, 160, 1, 3, {0xf9a31bff, 0xffd541ff, 0xfffc40ff}},
+	{"Water", MOVEMENT_LIQUID, 100, 5, 3, {0x143464ff, 0x285cc4ff, 0x249fdeff}},
+	{"Gas", MOVEMENT_GAS, 1, 1, 2, {0xb3b9d1ff, 0xb3b9d1ff}},
+};
+constexpr u32 MaterialCount = ArrayCount(gMaterialDefs);
+static_assert(MaterialCount == PIXEL_TYPE_COUNT, "Every pixel type needs a material definition");
+
+constexpr PixelType FirstMovingType = PixelType::SAND;
+
+constexpr bool AreMovingMaterialsLast()
+{
+	bool result = true;
+	for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+	{
+		bool isMoving = (gMaterialDefs[typeNum].movement >= MOVEMENT_POWDER);
+		result = result && (isMoving == (typeNum >= FirstMovingType));
+	}
+	return result;
+}
+static_assert(AreMovingMaterialsLast(), "Materials that move must all come after the ones that don't");
+
+// Directions a movement class tries in order, one pixel long. x is mirrored by the pixel's random direction bit,
+// and both are scaled by the material's velocity. Traced moves step along the path a pixel at a time and can
+// stop short, otherwise only the destination itself is tested
+struct MovementPattern
+{
+	s8 moves[5][2];
+	u8 moveCount;
+	bool tracePath;
+};
+
+constexpr MovementPattern gMovementPatterns[MOVEMENT_CLASS_COUNT] = {
+	{{}, 0, false}, // Empty
+	{{}, 0, false}, // Static
+	{{}, 0, false}, // Boundary
+	{{{0, 1}, {1, 1}, {-1, 1}}, 3, false}, // Powder
+	{{{0, 1}, {1, 1}, {-1, 1}, {1, 0}, {-1, 0}}, 5, true}, // Liquid
+	{{{0, -1}, {1, -1}, {-1, -1}, {1, 0}, {-1, 0}}, 5, true}, // Gas
+};
+
+constexpr Interaction GetMaterialInteraction(const MaterialDef &mover, const MaterialDef &target)
+{
+	Interaction result = INTERACTION_BLOCK;
+	if(mover.movement < MOVEMENT_POWDER)
+	{
+		result = INTERACTION_BLOCK; // Only moving materials go anywhere
+	}
+	else if(target.movement == MOVEMENT_EMPTY)
+	{
+		result = INTERACTION_MOVE;
+	}
+	else if(target.movement == MOVEMENT_BOUNDARY)
+	{
+		result = (mover.movement == MOVEMENT_GAS) ? INTERACTION_SINK : INTERACTION_BLOCK;
+	}
+	else if(mover.movement != MOVEMENT_GAS && target.movement == MOVEMENT_GAS)
+	{
+		result = INTERACTION_MOVE; // Gas gets crushed by anything heavier
+	}
+	else if(target.movement == MOVEMENT_LIQUID && mover.density > target.density)
+	{
+		result = INTERACTION_SWAP;
+	}
+	return result;
+}
+
+// How a pixel looks to powders moving into it, for kernels that handle powder a row at a time
+enum PowderTarget : u8
+{
+	POWDER_TARGET_OPEN, // Empty, every powder moves in
+	POWDER_TARGET_BLOCKED, // Every powder is blocked
+	POWDER_TARGET_OTHER, // Anything else, like swapping with a liquid, left to the per pixel update
+};
+
+constexpr PowderTarget GetPowderTarget(u32 targetType)
+{
+	bool allMove = true;
+	bool allBlock = true;
+	for(u32 moverNum = 0; moverNum < MaterialCount; ++moverNum)
+	{
+		if(gMaterialDefs[moverNum].movement == MOVEMENT_POWDER)
+		{
+			Interaction interaction = GetMaterialInteraction(gMaterialDefs[moverNum], gMaterialDefs[targetType]);
+			allMove = allMove && (interaction == INTERACTION_MOVE);
+			allBlock = allBlock && (interaction == INTERACTION_BLOCK);
+		}
+	}
+
+	PowderTarget result = POWDER_TARGET_OTHER;
+	if(gMaterialDefs[targetType].movement == MOVEMENT_EMPTY && allMove)
+	{
+		result = POWDER_TARGET_OPEN;
+	}
+	else if(allBlock)
+	{
+		result = POWDER_TARGET_BLOCKED;
+	}
+	return result;
+}
+
+// Sets of materials as a bit per material id, for scans that match several at once. Sized from MaterialCount, so
+// any number of materials fit
+constexpr u32 MaterialMaskWordCount = (MaterialCount + 63) / 64;
+
+struct MaterialMask
+{
+	u64 words[MaterialMaskWordCount];
+};
+
+constexpr MaterialMask GetMaterialBit(u32 type)
+{
+	MaterialMask result = {};
+	result.words[type / 64] = 1ULL << (type % 64);
+	return result;
+}
+
+constexpr bool HasMaterial(const MaterialMask &mask, u32 type)
+{
+	return (mask.words[type / 64] >> (type % 64)) & 1;
+}
+
+constexpr bool IsMaterialMaskEmpty(const MaterialMask &mask)
+{
+	u64 bits = 0;
+	for(u32 wordNum = 0; wordNum < MaterialMaskWordCount; ++wordNum)
+	{
+		bits |= mask.words[wordNum];
+	}
+	return bits == 0;
+}
+
+constexpr MaterialMask operator|(const MaterialMask &a, const MaterialMask &b)
+{
+	MaterialMask result = {};
+	for(u32 wordNum = 0; wordNum < MaterialMaskWordCount; ++wordNum)
+	{
+		result.words[wordNum] = a.words[wordNum] | b.words[wordNum];
+	}
+	return result;
+}
+
+constexpr MaterialMask operator&(const MaterialMask &a, const MaterialMask &b)
+{
+	MaterialMask result = {};
+	for(u32 wordNum = 0; wordNum < MaterialMaskWordCount; ++wordNum)
+	{
+		result.words[wordNum] = a.words[wordNum] & b.words[wordNum];
+	}
+	return result;
+}
+
+// Only sets bits that stand for a material, so the result can be tested for being empty
+constexpr MaterialMask operator~(const MaterialMask &mask)
+{
+	MaterialMask result = {};
+	for(u32 wordNum = 0; wordNum < MaterialMaskWordCount; ++wordNum)
+	{
+		u32 bitCount = MaterialCount - (wordNum * 64);
+		result.words[wordNum] = ~mask.words[wordNum] & ((bitCount >= 64) ? ~0ULL : ((1ULL << bitCount) - 1));
+	}
+	return result;
+}
+
+constexpr MaterialMask &operator|=(MaterialMask &a, const MaterialMask &b)
+{
+	a = a | b;
+	return a;
+}
+
+constexpr MaterialMask &operator&=(MaterialMask &a, const MaterialMask &b)
+{
+	a = a & b;
+	return a;
+}
+
+// Calls func with each material in mask, lowest id first
+template<typename Func>
+inline void ForEachMaterial(const MaterialMask &mask, Func func)
+{
+	for(u32 wordNum = 0; wordNum < MaterialMaskWordCount; ++wordNum)
+	{
+		for(u64 bits = mask.words[wordNum]; bits; bits &= bits - 1)
+		{
+			func((PixelType)((wordNum * 64) + CountTrailingZeros64(bits)));
+		}
+	}
+}
+
+// Flattened per material properties the update reads
+struct MaterialLookup
+{
+	MovementClass movement[MaterialCount];
+	u8 velocity[MaterialCount];
+	PowderTarget powderTargets[MaterialCount];
+	Interaction interactions[MaterialCount][MaterialCount]; // [mover][target]
+	MaterialMask passableTypes[MaterialCount]; // [mover], the target types it doesn't get blocked by
+};
+
+constexpr MaterialLookup BuildMaterialLookup()
+{
+	MaterialLookup result = {};
+	for(u32 moverNum = 0; moverNum < MaterialCount; ++moverNum)
+	{
+		result.movement[moverNum] = gMaterialDefs[moverNum].movement;
+		result.velocity[moverNum] = gMaterialDefs[moverNum].maxVelocity;
+		result.powderTargets[moverNum] = GetPowderTarget(moverNum);
+		for(u32 targetNum = 0; targetNum < MaterialCount; ++targetNum)
+		{
+			result.interactions[moverNum][targetNum] = GetMaterialInteraction(gMaterialDefs[moverNum], gMaterialDefs[targetNum]);
+			if(result.interactions[moverNum][targetNum] != INTERACTION_BLOCK)
+			{
+				result.passableTypes[moverNum] |= GetMaterialBit(targetNum);
+			}
+		}
+	}
+	return result;
+}
+
+constexpr MaterialLookup gMaterialLookup = BuildMaterialLookup();
+
+constexpr MaterialMask GetMovementTypeMask(MovementClass movement)
+{
+	MaterialMask result = {};
+	for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+	{
+		if(gMaterialLookup.movement[typeNum] == movement)
+		{
+			result |= GetMaterialBit(typeNum);
+		}
+	}
+	return result;
+}
+
+constexpr MaterialMask GetPowderTargetTypeMask(PowderTarget target)
+{
+	MaterialMask result = {};
+	for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+	{
+		if(gMaterialLookup.powderTargets[typeNum] == target)
+		{
+			result |= GetMaterialBit(typeNum);
+		}
+	}
+	return result;
+}
+
+inline bool IsMovingMaterial(PixelType type)
+{
+	return type >= FirstMovingType;
+}
+
+// One bit per moving class, for summarising which classes an area holds
+constexpr u32 MovingClassCount = MOVEMENT_CLASS_COUNT - MOVEMENT_POWDER;
+constexpr u32 MovingClassMaskCount = 1 << MovingClassCount;
+
+constexpr u32 GetMovingClassBit(MovementClass movement)
+{
+	return 1u << (movement - MOVEMENT_POWDER);
+}
+
+// The move a pixel takes only depends on which of its neighbours it can move into, as long as every move starts
+// with a step to one of them. Neighbourhood keys hold a bit for each pixel of the 3x3 block around a pixel, set when
+// the pixel isn't blocked by it, plus a bit above those for the random direction. Moves are then read from a table
+constexpr u32 NeighbourhoodBitCount = 9;
+constexpr u32 NeighbourhoodKeyCount = 1 << (NeighbourhoodBitCount + 1);
+constexpr u8 NoNeighbourhoodMove = 0xff;
+
+constexpr u32 GetNeighbourhoodBit(s32 xOffset, s32 yOffset)
+{
+	return (u32)(((yOffset + 1) * 3) + (xOffset + 1));
+}
+
+constexpr u32 GetNeighbourhoodKey(u32 neighbourBits, bool randomBit)
+{
+	return neighbourBits | ((u32)randomBit << NeighbourhoodBitCount);
+}
+
+// Offset of the first pixel a move tests, before x is mirrored. Traced moves step like PhysicsMoveTest, so
+// along x first unless the move is steeper than 45 degrees. Other moves only test their destination
+constexpr void GetFirstMoveStep(const MovementPattern &pattern, u32 moveNum, s32 *outX, s32 *outY)
+{
+	s32 moveX = pattern.moves[moveNum][0];
+	s32 moveY = pattern.moves[moveNum][1];
+	bool xFirst = (moveX != 0) && ((moveX < 0 ? -moveX : moveX) >= (moveY < 0 ? -moveY : moveY));
+	*outX = (!pattern.tracePath || xFirst) ? moveX : 0;
+	*outY = (!pattern.tracePath || !xFirst) ? moveY : 0;
+}
+
+constexpr bool CanUseNeighbourhoodMoves()
+{
+	bool result = true;
+	for(u32 typeNum = 0; typeNum < MaterialCount; ++typeNum)
+	{
+		const MaterialDef &material = gMaterialDefs[typeNum];
+		if(material.movement >= MOVEMENT_POWDER)
+		{
+			const MovementPattern &pattern = gMovementPatterns[material.movement];
+			result = result && (material.maxVelocity >= 1) && (pattern.tracePath || material.maxVelocity == 1);
+			for(u32 moveNum = 0; moveNum < pattern.moveCount; ++moveNum)
+			{
+				s32 moveX = pattern.moves[moveNum][0];
+				s32 moveY = pattern.moves[moveNum][1];
+				result = result && (moveX != 0 || moveY != 0) && (moveX >= -1 && moveX <= 1) && (moveY >= -1 && moveY <= 1);
+			}
+		}
+	}
+	return result;
+}
+
+struct NeighbourhoodMoveTable
+{
+	u8 moves[MovingClassCount][NeighbourhoodKeyCount]; // Index into the class's movement pattern, or NoNeighbourhoodMove
+};
+
+constexpr NeighbourhoodMoveTable BuildNeighbourhoodMoveTable()
+{
+	NeighbourhoodMoveTable result = {};
+	for(u32 classNum = 0; classNum < MovingClassCount; ++classNum)
+	{
+		const MovementPattern &pattern = gMovementPatterns[MOVEMENT_POWDER + classNum];
+		for(u32 key = 0; key < NeighbourhoodKeyCount; ++key)
+		{
+			s32 xSign = (key >> NeighbourhoodBitCount) ? 1 : -1;
+			u8 move = NoNeighbourhoodMove;
+			for(u32 moveNum = 0; moveNum < pattern.moveCount && move == NoNeighbourhoodMove; ++moveNum)
+			{
+				s32 stepX = 0;
+				s32 stepY = 0;
+				GetFirstMoveStep(pattern, moveNum, &stepX, &stepY);
+				if((key >> GetNeighbourhoodBit(stepX * xSign, stepY)) & 1)
+				{
+					move = (u8)moveNum;
+				}
+			}
+			result.moves[classNum][key] = move;
+		}
+	}
+	return result;
+}
+
+constexpr NeighbourhoodMoveTable gNeighbourhoodMoves = BuildNeighbourhoodMoveTable();
+
+inline const char *PixelTypeToString(PixelType type)
+{
+	Assert(type < MaterialCount);
+	return gMaterialDefs[type].name;
+}
+
+inline u8 GetTypeColorVariant(PixelType type, u32 randValue)
+{
+	u8 result = (u8)(randValue % gMaterialDefs[type].colorCount);
+	return result;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// Counter based random numbers. Every value is a pure function of (seed, stream, frame, x, y),
+// so there is no hidden state, any thread can ask in any order and a replay gets the same values
+
+enum RandomStream : u32
+{
+	RANDOM_STREAM_DIRECTION = 0, // Left/right choice of moving pixels
+	RANDOM_STREAM_COLOR = 1, // Color variant of spawned pixels
+
+	RANDOM_STREAM_COUNT
+};
+
+// SplitMix64 finaliser, every input bit affects every output bit
+inline u64 MixRandomBits(u64 value)
+{
+	value ^= value >> 30;
+	value *= 0xbf58476d1ce4e5b9ULL;
+	value ^= value >> 27;
+	value *= 0x94d049bb133111ebULL;
+	value ^= value >> 31;
+	return value;
+}
+
+// Key shared by every random value of a stream within a single frame
+inline u64 GetRandomFrameKey(u64 seed, u32 stream, u32 frameNum)
+{
+	u64 result = MixRandomBits(seed ^ MixRandomBits(((u64)stream << 32) | frameNum));
+	return result;
+}
+
+// 64 random bits for a counter under a frame key
+inline u64 GetRandomBits(u64 frameKey, u32 counterX, u32 counterY)
+{
+	u64 result = MixRandomBits(frameKey ^ (((u64)counterY << 32) | counterX));
+	return result;
+}
@@ -0,0 +1,320 @@
+#pragma once
+
+// Checks run by starting with --test rather than opening the window. Each steps a few small scenes and prints what
+// didn't hold, and the process returns how many checks failed
+
+constexpr u32 TestSimWidth = 400;
+constexpr u32 TestSimHeight = 224;
+constexpr u32 TestSceneCount = 4;
+constexpr u32 TestSimSteps = 1500;
+
+// Stone floor and shelves, with sand, water, both plus gas, or sand down a one pixel shaft above them
+static void BuildTestScene(PixelSim *sim, u32 sceneNum)
+{
+	for(s32 x = 0; x < (s32)TestSimWidth; ++x)
+	{
+		sim->CreatePixel(x, TestSimHeight - 1, PixelType::STONE);
+	}
+	for(s32 x = 50; x < 150; ++x)
+	{
+		sim->CreatePixel(x, 150, PixelType::STONE);
+	}
+	for(s32 x = 250; x < 330; x += 2)
+	{
+		sim->CreatePixel(x, 120, PixelType::STONE);
+	}
+
+	if(sceneNum == 0 || sceneNum == 2)
+	{
+		for(s32 y = 10; y < 90; ++y)
+		{
+			for(s32 x = 60; x < 200; ++x)
+			{
+				if(((x * 7) + (y * 13)) % 5 != 0)
+				{
+					sim->CreatePixel(x, y, PixelType::SAND);
+				}
+			}
+		}
+	}
+	if(sceneNum == 1 || sceneNum == 2)
+	{
+		for(s32 y = 20; y < 80; ++y)
+		{
+			for(s32 x = 220; x < 380; ++x)
+			{
+				if(((x * 3) + (y * 5)) % 4 != 0)
+				{
+					sim->CreatePixel(x, y, PixelType::WATER);
+				}
+			}
+		}
+	}
+	if(sceneNum == 2)
+	{
+		for(s32 y = 180; y < 215; ++y)
+		{
+			for(s32 x = 10; x < 120; ++x)
+			{
+				if((x + y) % 3 == 0)
+				{
+					sim->CreatePixel(x, y, PixelType::GAS);
+				}
+			}
+		}
+	}
+	if(sceneNum == 3)
+	{
+		for(s32 y = 0; y < (s32)TestSimHeight - 1; ++y)
+		{
+			sim->CreatePixel(100, y, PixelType::STONE);
+			sim->CreatePixel(102, y, PixelType::STONE);
+		}
+		for(s32 y = 5; y < 150; ++y)
+		{
+			sim->CreatePixel(101, y, PixelType::SAND);
+			for(s32 x = 200; x < 203; ++x)
+			{
+				sim->CreatePixel(x, y, PixelType::SAND);
+			}
+		}
+	}
+}
+
+// Steps a scene, dropping a line of sand onto it partway through so settled regions have to wake again. Hashes of
+// every step are left in the sim. Returns how many region updates visited just their active cells
+static u32 RunTestScene(PixelSim *sim, u32 sceneNum)
+{
+	sim->SetRandomSeed(12345);
+	sim->SetDeterministic(true);
+	sim->SetHashVerification(true);
+	BuildTestScene(sim, sceneNum);
+
+	u32 activeCellUpdates = 0;
+	for(u32 stepNum = 0; stepNum < TestSimSteps; ++stepNum)
+	{
+		if(stepNum == 200)
+		{
+			for(s32 x = 150; x < 250; ++x)
+			{
+				sim->CreatePixel(x, 2, PixelType::SAND);
+			}
+		}
+		sim->UpdateSim(1.0f / gSimFPS);
+		activeCellUpdates += sim->GetActiveCellRegionCount();
+	}
+	return activeCellUpdates;
+}
+
+// Returns the first step two runs hashed differently, or -1 if they match throughout
+static s32 FindHashMismatch(PixelSim *simA, PixelSim *simB)
+{
+	Assert(simA->GetStateHashCount() == simB->GetStateHashCount());
+	u32 *hashesA = simA->GetStateHashes();
+	u32 *hashesB = simB->GetStateHashes();
+	for(u32 stepNum = 0; stepNum < simA->GetStateHashCount(); ++stepNum)
+	{
+		if(hashesA[stepNum] != hashesB[stepNum])
+		{
+			return (s32)stepNum;
+		}
+	}
+	return -1;
+}
+
+// Deterministic mode has to step the sim exactly the same at any thread count, on either engine
+static u32 TestThreadCounts()
+{
+	constexpr u32 RegionSizes[] = {16, 64};
+	constexpr u32 ThreadCounts[] = {2, 4, 8};
+
+	u32 failCount = 0;
+	for(u32 engine = 0; engine < UPDATE_ENGINE_COUNT; ++engine)
+	{
+		for(u32 sceneNum = 0; sceneNum < TestSceneCount; ++sceneNum)
+		{
+			for(u32 regionSize : RegionSizes)
+			{
+				PixelSim singleSim(TestSimWidth, TestSimHeight, SimPixelScale, regionSize, 1);
+				singleSim.SetUpdateEngine((UpdateEngine)engine);
+				RunTestScene(&singleSim, sceneNum);
+
+				for(u32 threadCount : ThreadCounts)
+				{
+					PixelSim threadedSim(TestSimWidth, TestSimHeight, SimPixelScale, regionSize, threadCount);
+					threadedSim.SetUpdateEngine((UpdateEngine)engine);
+					RunTestScene(&threadedSim, sceneNum);
+
+					s32 stepNum = FindHashMismatch(&singleSim, &threadedSim);
+					if(stepNum >= 0)
+					{
+						printf("FAIL thread counts: %s engine, scene %u, region size %u, 1 vs %u threads, step %d\n",
+							UpdateEngineToString(threadedSim.GetUpdateEngine()), sceneNum, regionSize, threadCount,
+							stepNum);
+						++failCount;
+					}
+				}
+			}
+		}
+	}
+	return failCount;
+}
+
+// The SIMD kernels have to step the sim exactly as the scalar ones do, at every level the CPU supports
+static u32 TestSimdLevels()
+{
+	constexpr u32 RegionSize = 64;
+	constexpr u32 ThreadCount = 4;
+
+	u32 failCount = 0;
+	for(u32 sceneNum = 0; sceneNum < TestSceneCount; ++sceneNum)
+	{
+		SelectSimdKernels(CPU_LEVEL_SCALAR);
+		PixelSim scalarSim(TestSimWidth, TestSimHeight, SimPixelScale, RegionSize, ThreadCount);
+		RunTestScene(&scalarSim, sceneNum);
+
+		for(u32 level = CPU_LEVEL_SCALAR + 1; level <= (u32)GetCpuFeatureLevel(); ++level)
+		{
+			SelectSimdKernels((CpuFeatureLevel)level);
+			PixelSim simdSim(TestSimWidth, TestSimHeight, SimPixelScale, RegionSize, ThreadCount);
+			RunTestScene(&simdSim, sceneNum);
+
+			s32 stepNum = FindHashMismatch(&scalarSim, &simdSim);
+			if(stepNum >= 0)
+			{
+				printf("FAIL SIMD levels: scene %u, %s vs scalar kernels, step %d\n", sceneNum,
+					CpuFeatureLevelToString((CpuFeatureLevel)level), stepNum);
+				++failCount;
+			}
+		}
+	}
+	SelectSimdKernels(GetCpuFeatureLevel());
+	return failCount;
+}
+
+// The bit sliced powder kernel has to step the sim exactly as the per pixel scan does
+static u32 TestBitSlicedPowder()
+{
+	constexpr u32 RegionSizes[] = {16, 64};
+	constexpr u32 ThreadCount = 4;
+
+	u32 failCount = 0;
+	for(u32 sceneNum = 0; sceneNum < TestSceneCount; ++sceneNum)
+	{
+		for(u32 regionSize : RegionSizes)
+		{
+			PixelSim bitSim(TestSimWidth, TestSimHeight, SimPixelScale, regionSize, ThreadCount);
+			bitSim.SetBitSlicedPowder(true);
+			RunTestScene(&bitSim, sceneNum);
+
+			PixelSim pixelSim(TestSimWidth, TestSimHeight, SimPixelScale, regionSize, ThreadCount);
+			pixelSim.SetBitSlicedPowder(false);
+			RunTestScene(&pixelSim, sceneNum);
+
+			s32 stepNum = FindHashMismatch(&bitSim, &pixelSim);
+			if(stepNum >= 0)
+			{
+				printf("FAIL bit sliced powder: scene %u, region size %u, step %d\n", sceneNum, regionSize, stepNum);
+				++failCount;
+			}
+		}
+	}
+	return failCount;
+}
+
+// Narrowing a region's rows to its active cells, or visiting just those, has to step the sim exactly as scanning its
+// whole dirty rect does
+static u32 TestNarrowedScans()
+{
+	constexpr u32 RegionSizes[] = {16, 64};
+	constexpr u32 ThreadCounts[] = {1, 4};
+
+	u32 failCount = 0;
+	for(u32 sceneNum = 0; sceneNum < TestSceneCount; ++sceneNum)
+	{
+		for(u32 regionSize : RegionSizes)
+		{
+			for(u32 threadCount : ThreadCounts)
+			{
+				PixelSim narrowedSim(TestSimWidth, TestSimHeight, SimPixelScale, regionSize, threadCount);
+				u32 activeCellUpdates = RunTestScene(&narrowedSim, sceneNum);
+
+				PixelSim rectSim(TestSimWidth, TestSimHeight, SimPixelScale, regionSize, threadCount);
+				rectSim.SetFullRectScans(true);
+				RunTestScene(&rectSim, sceneNum);
+
+				s32 stepNum = FindHashMismatch(&narrowedSim, &rectSim);
+				if(stepNum >= 0)
+				{
+					printf("FAIL narrowed scans: scene %u, region size %u, %u threads, step %d hash %08x vs %08x\n",
+						sceneNum, regionSize, threadCount, stepNum, narrowedSim.GetStateHashes()[stepNum],
+						rectSim.GetStateHashes()[stepNum]);
+					++failCount;
+				}
+
+				// Moving pixels thin out as the scene settles, so some regions should have been sparse enough
+				if(activeCellUpdates == 0)
+				{
+					printf("FAIL narrowed scans: scene %u, region size %u, %u threads, no region visited its active cells\n",
+						sceneNum, regionSize, threadCount);
+					++failCount;
+				}
+			}
+		}
+	}
+	return failCount;
+}
+
+// Water settled on the floor, across a row of regions, keeps trading pixels over their borders along its surface. That
+// mustn't keep them awake, so the whole pool has to go to sleep
+static u32 TestSettledPoolSleeps()
+{
+	constexpr u32 RegionSize = 64;
+	constexpr u32 MaxSteps = 6000;
+
+	PixelSim sim(TestSimWidth, TestSimHeight, SimPixelScale, RegionSize, 1);
+	sim.SetRandomSeed(12345);
+	sim.SetDeterministic(true);
+	for(s32 x = 0; x < (s32)TestSimWidth; ++x)
+	{
+		sim.CreatePixel(x, TestSimHeight - 1, PixelType::STONE);
+	}
+	// Leaves the top row of the pool partly filled
+	for(s32 y = TestSimHeight - 23; y < (s32)TestSimHeight - 1; ++y)
+	{
+		for(s32 x = 0; x < (s32)TestSimWidth; ++x)
+		{
+			if(((x * 3) + (y * 5)) % 5 != 0)
+			{
+				sim.CreatePixel(x, y, PixelType::WATER);
+			}
+		}
+	}
+
+	u32 poolRegionCount = TestSimWidth / RegionSize;
+	for(u32 stepNum = 0; stepNum < MaxSteps; ++stepNum)
+	{
+		sim.UpdateSim(1.0f / gSimFPS);
+		if(sim.GetAwakeRegionCount() == 0 && sim.GetSleepingRegionCount() >= poolRegionCount)
+		{
+			return 0;
+		}
+	}
+
+	printf("FAIL settled pool: %u regions still awake, %u asleep after %u steps\n", sim.GetAwakeRegionCount(),
+		sim.GetSleepingRegionCount(), MaxSteps);
+	return 1;
+}
+
+static int RunSimTests()
+{
+	u32 failCount = 0;
+	failCount += TestThreadCounts();
+	failCount += TestSimdLevels();
+	failCount += TestBitSlicedPowder();
+	failCount += TestNarrowedScans();
+	failCount += TestSettledPoolSleeps();
+
+	printf("%s, %u failed\n", (failCount == 0) ? "Tests passed" : "Tests failed", failCount);
+	return (int)failCount;
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+// Wide scans over the pixel planes. Every kernel has a scalar version plus ones for wider instruction sets,
+// each built for its own target so one binary carries them all. The widest the CPU supports is picked at startup
+
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_SCAN_X86 1
+#endif
+
+#if defined(_MSC_VER)
+#define SIMD_TARGET_SSE41
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+#else
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+
+// Bytes that may be read past the end of a scanned span, so planes need this much padding on the end
+constexpr u32 SimdScanOverread = 64;
+
+// Most palette entries the AVX-512 kernel can hold in its two registers
+constexpr u32 RegisterPaletteSize = 32;
+
+// Palettes handed to ExpandColors have an entry for every material's color variants, padded out to at least
+// RegisterPaletteSize entries so the registers can always be loaded
+constexpr u32 ColorPaletteSize = MAX(MaterialCount * MaxColorVariants, RegisterPaletteSize);
+
+inline u64 MaskScanBits(u64 bits, u32 count)
+{
+	Assert(count <= 64);
+	u64 result = (count < 64) ? (bits & ((1ULL << count) - 1)) : bits;
+	return result;
+}
+
+// Bit i is set when types[i] >= firstMovingType, for the first count (up to 64) types.
+// Wide versions always read 64 bytes, whatever count is
+inline u64 GetMovableMaskScalar(const u8 *types, u32 count, u8 firstMovingType)
+{
+	u64 result = 0;
+	for(u32 typeNum = 0; typeNum < count; ++typeNum)
+	{
+		result |= (u64)(types[typeNum] >= firstMovingType) << typeNum;
+	}
+	return result;
+}
+
+// Type set masks look types up in a byte shuffle, so they only cover this many types
+constexpr u32 TypeSetTableSize = 16;
+
+// Bit i is set when bit types[i] of typeMask is, for the first count (up to 64) types. Types must be below TypeSetTableSize
+inline u64 GetTypeSetMaskScalar(const u8 *types, u32 count, u32 typeMask)
+{
+	u64 result = 0;
+	for(u32 typeNum = 0; typeNum < count; ++typeNum)
+	{
+		result |= (u64)((typeMask >> types[typeNum]) & 1) << typeNum;
+	}
+	return result;
+}
+
+// Colors of count pixels, from the palette entry of each type and color variant pair
+inline void ExpandColorsScalar(const u8 *types, const u8 *variants, u32 count, const u32 *palette, u32 *dest)
+{
+	for(u32 pixelNum = 0; pixelNum < count; ++pixelNum)
+	{
+		dest[pixelNum] = palette[(types[pixelNum] * MaxColorVariants) + variants[pixelNum]];
+	}
+}
+
+#if SIMD_SCAN_X86
+
+// SSE2 is part of x64, so these need no target of their own
+inline u64 GetMovableMaskSSE2(const u8 *types, u32 count, u8 firstMovingType)
+{
+	// Unsigned bytes have no greater or equal compare, but a >= b exactly when max(a, b) == a
+	__m128i threshold = _mm_set1_epi8((char)firstMovingType);
+	u64 result = 0;
+	for(u32 blockNum = 0; blockNum < 4; ++blockNum)
+	{
+		__m128i blockTypes = _mm_loadu_si128((const __m128i *)(types + (blockNum * 16)));
+		u32 blockMask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(blockTypes, threshold), blockTypes));
+		result |= (u64)blockMask << (blockNum * 16);
+	}
+	return MaskScanBits(result, count);
+}
+
+// Without a byte shuffle, each type in the set gets a compare of its own
+inline u64 GetTypeSetMaskSSE2(const u8 *types, u32 count, u32 typeMask)
+{
+	u64 result = 0;
+	for(u32 blockNum = 0; blockNum < 4; ++blockNum)
+	{
+		__m128i blockTypes = _mm_loadu_si128((const __m128i *)(types + (blockNum * 16)));
+		__m128i blockMatches = _mm_setzero_si128();
+		for(u32 setTypes = typeMask; setTypes; setTypes &= setTypes - 1)
+		{
+			__m128i match = _mm_set1_epi8((char)CountTrailingZeros64(setTypes));
+			blockMatches = _mm_or_si128(blockMatches, _mm_cmpeq_epi8(blockTypes, match));
+		}
+		result |= (u64)(u32)_mm_movemask_epi8(blockMatches) << (blockNum * 16);
+	}
+	return MaskScanBits(result, count);
+}
+
+// Byte i of the result is all ones when bit i of the low 16 bits of typeMask is set, as a table to shuffle types through
+SIMD_TARGET_SSE41 inline __m128i GetTypeSetTable(u32 typeMask)
+{
+	__m128i maskBytes = _mm_shuffle_epi8(_mm_cvtsi32_si128((int)typeMask), _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1));
+	__m128i bitSelect = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	return _mm_cmpeq_epi8(_mm_and_si128(maskBytes, bitSelect), bitSelect);
+}
+
+SIMD_TARGET_SSE41 inline u64 GetTypeSetMaskSSE41(const u8 *types, u32 count, u32 typeMask)
+{
+	__m128i table = GetTypeSetTable(typeMask);
+	u64 result = 0;
+	for(u32 blockNum = 0; blockNum < 4; ++blockNum)
+	{
+		__m128i blockTypes = _mm_loadu_si128((const __m128i *)(types + (blockNum * 16)));
+		result |= (u64)(u32)_mm_movemask_epi8(_mm_shuffle_epi8(table, blockTypes)) << (blockNum * 16);
+	}
+	return MaskScanBits(result, count);
+}
+
+SIMD_TARGET_AVX2 inline u64 GetMovableMaskAVX2(const u8 *types, u32 count, u8 firstMovingType)
+{
+	__m256i threshold = _mm256_set1_epi8((char)firstMovingType);
+	__m256i lowTypes = _mm256_loadu_si256((const __m256i *)types);
+	__m256i highTypes = _mm256_loadu_si256((const __m256i *)(types + 32));
+	u32 lowMask = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(lowTypes, threshold), lowTypes));
+	u32 highMask = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(highTypes, threshold), highTypes));
+	return MaskScanBits(((u64)highMask << 32) | lowMask, count);
+}
+
+SIMD_TARGET_AVX2 inline u64 GetTypeSetMaskAVX2(const u8 *types, u32 count, u32 typeMask)
+{
+	__m256i table = _mm256_broadcastsi128_si256(GetTypeSetTable(typeMask));
+	u32 lowMask = (u32)_mm256_movemask_epi8(_mm256_shuffle_epi8(table, _mm256_loadu_si256((const __m256i *)types)));
+	u32 highMask = (u32)_mm256_movemask_epi8(_mm256_shuffle_epi8(table, _mm256_loadu_si256((const __m256i *)(types + 32))));
+	return MaskScanBits(((u64)highMask << 32) | lowMask, count);
+}
+
+// Eight pixels at a time, gathering their colors from the palette
+SIMD_TARGET_AVX2 inline void ExpandColorsAVX2(const u8 *types, const u8 *variants, u32 count, const u32 *palette, u32 *dest)
+{
+	static_assert(MaxColorVariants == 4, "Palette index is built with a shift");
+	u32 pixelNum = 0;
+	for(; (pixelNum + 8) <= count; pixelNum += 8)
+	{
+		__m256i typeIndices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(types + pixelNum)));
+		__m256i variantIndices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(variants + pixelNum)));
+		__m256i paletteIndices = _mm256_or_si256(_mm256_slli_epi32(typeIndices, 2), variantIndices);
+		__m256i colors = _mm256_i32gather_epi32((const int *)palette, paletteIndices, 4);
+		_mm256_storeu_si256((__m256i *)(dest + pixelNum), colors);
+	}
+	ExpandColorsScalar(types + pixelNum, variants + pixelNum, count - pixelNum, palette, dest + pixelNum);
+}
+
+SIMD_TARGET_AVX512 inline u64 GetMovableMaskAVX512(const u8 *types, u32 count, u8 firstMovingType)
+{
+	__m512i blockTypes = _mm512_loadu_si512((const void *)types);
+	u64 result = (u64)_mm512_cmpge_epu8_mask(blockTypes, _mm512_set1_epi8((char)firstMovingType));
+	return MaskScanBits(result, count);
+}
+
+SIMD_TARGET_AVX512 inline u64 GetTypeSetMaskAVX512(const u8 *types, u32 count, u32 typeMask)
+{
+	__m512i table = _mm512_broadcast_i32x4(GetTypeSetTable(typeMask));
+	__m512i blockTypes = _mm512_loadu_si512((const void *)types);
+	u64 result = (u64)_mm512_movepi8_mask(_mm512_shuffle_epi8(table, blockTypes));
+	return MaskScanBits(result, count);
+}
+
+// Sixteen pixels at a time, with the palette in two registers so colors are looked up with a permute. Only picked
+// when the whole palette fits, larger ones are left to the AVX2 gather
+SIMD_TARGET_AVX512 inline void ExpandColorsAVX512(const u8 *types, const u8 *variants, u32 count, const u32 *palette, u32 *dest)
+{
+	static_assert(MaxColorVariants == 4, "Palette index is built with a shift");
+	static_assert(RegisterPaletteSize == 32, "Palette is held in two registers of sixteen colors");
+	__m512i paletteLow = _mm512_loadu_si512((const void *)palette);
+	__m512i paletteHigh = _mm512_loadu_si512((const void *)(palette + 16));
+
+	u32 pixelNum = 0;
+	for(; (pixelNum + 16) <= count; pixelNum += 16)
+	{
+		__m512i typeIndices = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(types + pixelNum)));
+		__m512i variantIndices = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(variants + pixelNum)));
+		__m512i paletteIndices = _mm512_or_si512(_mm512_slli_epi32(typeIndices, 2), variantIndices);
+		__m512i colors = _mm512_permutex2var_epi32(paletteLow, paletteIndices, paletteHigh);
+		_mm512_storeu_si512((void *)(dest + pixelNum), colors);
+	}
+	ExpandColorsScalar(types + pixelNum, variants + pixelNum, count - pixelNum, palette, dest + pixelNum);
+}
+
+#endif
+
+// The kernels picked for the running CPU
+struct SimdKernels
+{
+	CpuFeatureLevel level;
+	u64 (*getMovableMask)(const u8 *types, u32 count, u8 firstMovingType);
+	u64 (*getTypeSetMask)(const u8 *types, u32 count, u32 typeMask);
+	void (*expandColors)(const u8 *types, const u8 *variants, u32 count, const u32 *palette, u32 *dest);
+};
+
+// Widest kernel of each kind at or below level. Levels without a kernel of their own use the next one down
+inline SimdKernels GetSimdKernels(CpuFeatureLevel level)
+{
+	SimdKernels result = {CPU_LEVEL_SCALAR, GetMovableMaskScalar, GetTypeSetMaskScalar, ExpandColorsScalar};
+#if SIMD_SCAN_X86
+	if(level >= CPU_LEVEL_SSE2)
+	{
+		result.getMovableMask = GetMovableMaskSSE2;
+		result.getTypeSetMask = GetTypeSetMaskSSE2;
+	}
+	if(level >= CPU_LEVEL_SSE41)
+	{
+		result.getTypeSetMask = GetTypeSetMaskSSE41;
+	}
+	if(level >= CPU_LEVEL_AVX2)
+	{
+		result.getMovableMask = GetMovableMaskAVX2;
+		result.getTypeSetMask = GetTypeSetMaskAVX2;
+		result.expandColors = ExpandColorsAVX2;
+	}
+	if(level >= CPU_LEVEL_AVX512)
+	{
+		result.getMovableMask = GetMovableMaskAVX512;
+		result.getTypeSetMask = GetTypeSetMaskAVX512;
+		if(ColorPaletteSize <= RegisterPaletteSize)
+		{
+			result.expandColors = ExpandColorsAVX512;
+		}
+	}
+	result.level = level;
+#endif
+	return result;
+}
+
+static CpuFeatureLevel globalCpuFeatureLevel = DetectCpuFeatureLevel();
+static SimdKernels globalSimdKernels = GetSimdKernels(globalCpuFeatureLevel);
+
+// Switch kernels, such as down to scalar to compare against. Never goes above what the CPU supports
+inline void SelectSimdKernels(CpuFeatureLevel level)
+{
+	globalSimdKernels = GetSimdKernels(MIN(level, globalCpuFeatureLevel));
+}
+
+inline CpuFeatureLevel GetCpuFeatureLevel()
+{
+	return globalCpuFeatureLevel;
+}
+
+inline CpuFeatureLevel GetSimdKernelLevel()
+{
+	return globalSimdKernels.level;
+}
+
+inline u64 GetMovableMask(const u8 *types, u32 count, u8 firstMovingType)
+{
+	Assert(count <= 64);
+	return globalSimdKernels.getMovableMask(types, count, firstMovingType);
+}
+
+inline u64 GetTypeSetMask(const u8 *types, u32 count, u32 typeMask)
+{
+	Assert(count <= 64);
+	return globalSimdKernels.getTypeSetMask(types, count, typeMask);
+}
+
+inline void ExpandColors(const u8 *types, const u8 *variants, u32 count, const u32 *palette, u32 *dest)
+{
+	globalSimdKernels.expandColors(types, variants, count, palette, dest);
+}
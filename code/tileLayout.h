@@ -0,0 +1,111 @@
+#pragma once
+
+// Spreads the low 16 bits of value out to the even bits of the result
+inline u32 SpreadBits16(u32 value)
+{
+	value &= 0x0000ffff;
+	value = (value | (value << 8)) & 0x00ff00ff;
+	value = (value | (value << 4)) & 0x0f0f0f0f;
+	value = (value | (value << 2)) & 0x33333333;
+	value = (value | (value << 1)) & 0x55555555;
+	return value;
+}
+
+// Z order index, interleaving the bits of x and y so nearby pixels in both directions stay close in memory
+inline u32 MortonEncode(u32 x, u32 y)
+{
+	u32 result = SpreadBits16(x) | (SpreadBits16(y) << 1);
+	return result;
+}
+
+// Where a pixel lives within the sim planes. The sim is split into square tiles of a power of two size,
+// each stored contiguously, so everything a region update touches within its own tile sits in one block of memory.
+// Inside a tile pixels are row major, or in Morton order when MortonOrder is set.
+// A ring of border tiles can surround the sim, addressed with negative or past the edge coordinates
+template<bool MortonOrder>
+struct TileLayout
+{
+	u32 tileShift; // Log2 of the tile side
+	u32 tileMask;
+	u32 tileColumns; // Including the border
+	u32 tileRows;
+	s32 borderSize; // In pixels, always whole tiles
+
+	void Init(u32 tileSize, u32 simWidth, u32 simHeight, u32 borderTiles)
+	{
+		Assert(tileSize > 0 && (tileSize & (tileSize - 1)) == 0); // Tiles must be a power of two
+
+		tileShift = 0;
+		while((1u << tileShift) < tileSize)
+		{
+			++tileShift;
+		}
+		tileMask = tileSize - 1;
+		tileColumns = ((simWidth + tileMask) >> tileShift) + (2 * borderTiles);
+		tileRows = ((simHeight + tileMask) >> tileShift) + (2 * borderTiles);
+		borderSize = borderTiles * tileSize;
+	}
+
+	inline u32 GetTileArea() const
+	{
+		return 1u << (2 * tileShift);
+	}
+
+	inline u32 GetCellCount() const
+	{
+		return tileColumns * tileRows * GetTileArea();
+	}
+
+	// Index within a tile of a pixel at local coordinates
+	inline u32 GetLocalIndex(u32 localX, u32 localY) const
+	{
+		u32 result = MortonOrder ? MortonEncode(localX, localY) : ((localY << tileShift) | localX);
+		return result;
+	}
+
+	// Index change for a pixel offset, only valid while both pixels are in the same row major tile
+	inline s32 GetIndexDelta(s32 xOffset, s32 yOffset) const
+	{
+		Assert(!MortonOrder);
+		s32 result = (yOffset * (1 << tileShift)) + xOffset;
+		return result;
+	}
+
+	inline u32 GetTileStart(u32 tileIndex) const
+	{
+		return tileIndex << (2 * tileShift);
+	}
+
+	inline u32 GetIndex(s32 x, s32 y) const
+	{
+		u32 storedX = (u32)(x + borderSize);
+		u32 storedY = (u32)(y + borderSize);
+		u32 tileIndex = ((storedY >> tileShift) * tileColumns) + (storedX >> tileShift);
+		u32 result = GetTileStart(tileIndex) | GetLocalIndex(storedX & tileMask, storedY & tileMask);
+		return result;
+	}
+};
+
+// Pixel accessors over a single plane, so callers never deal with the addressing themselves
+template<typename T, typename Layout>
+inline T &GetPlaneCell(T *plane, const Layout &layout, s32 x, s32 y)
+{
+	return plane[layout.GetIndex(x, y)];
+}
+
+// Fills the pixels [minX, maxX] x [minY, maxY] of a row major buffer of the given width from tiled planes.
+// convertFunc is given the tiled index of each pixel. Used to hand tiled data to anything expecting a flat image
+template<typename DestT, typename Layout, typename ConvertFunc>
+void CopyTiledToLinear(const Layout &layout, DestT *dest, u32 destWidth,
+	u32 minX, u32 maxX, u32 minY, u32 maxY, ConvertFunc convertFunc)
+{
+	for(u32 y = minY; y <= maxY; ++y)
+	{
+		DestT *destRow = dest + (y * destWidth);
+		for(u32 x = minX; x <= maxX; ++x)
+		{
+			u32 index = layout.GetIndex(x, y);
+			destRow[x] = convertFunc(index);
+		}
+	}
+}
@@ -52,6 +52,7 @@
 #define Align4(Value) ((Value + 3) & ~3)
 #define Align8(Value) ((Value + 7) & ~7)
 #define Align16(Value) ((Value + 15) & ~15)
+#define Align64(Value) ((Value + 63) & ~63)
 
 #define OffsetOf(type, Member) &(((type *)0)->Member)
 
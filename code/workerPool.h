@@ -0,0 +1,246 @@
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// Called once on every thread of the pool, the calling thread included as worker 0
+typedef void WorkerJobFunc(void *userData, u32 workerIndex);
+
+// Persistent pool of worker threads. Run() wakes every worker to execute the same job
+// and only returns once they have all finished, so each call acts as a barrier
+class WorkerPool
+{
+public:
+	// threadCount includes the calling thread. Zero picks one thread per hardware thread
+	WorkerPool(u32 threadCount)
+	{
+		if(threadCount == 0)
+		{
+			threadCount = MAX(std::thread::hardware_concurrency(), 1);
+		}
+		m_threadCount = threadCount;
+
+		m_jobFunc = nullptr;
+		m_jobUserData = nullptr;
+		m_jobGeneration = 0;
+		m_workersPending = 0;
+		m_shutdown = false;
+
+		m_threads = nullptr;
+		if(m_threadCount > 1)
+		{
+			m_threads = new std::thread[m_threadCount - 1];
+			for(u32 threadNum = 1; threadNum < m_threadCount; ++threadNum)
+			{
+				m_threads[threadNum - 1] = std::thread(WorkerThreadMain, this, threadNum);
+			}
+		}
+	}
+
+	~WorkerPool()
+	{
+		if(m_threads)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_shutdown = true;
+			}
+			m_wakeCondition.notify_all();
+
+			for(u32 threadNum = 1; threadNum < m_threadCount; ++threadNum)
+			{
+				m_threads[threadNum - 1].join();
+			}
+			delete[] m_threads;
+		}
+	}
+
+	inline u32 GetThreadCount()
+	{
+		return m_threadCount;
+	}
+
+	void Run(WorkerJobFunc *jobFunc, void *userData)
+	{
+		if(m_threadCount == 1)
+		{
+			jobFunc(userData, 0);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_jobFunc = jobFunc;
+			m_jobUserData = userData;
+			m_workersPending.store(m_threadCount - 1);
+			m_jobGeneration.fetch_add(1);
+		}
+		m_wakeCondition.notify_all();
+
+		jobFunc(userData, 0);
+
+		// Stages are short, so spin a little before paying for a sleep
+		for(u32 spinNum = 0; spinNum < WorkerSpinCount; ++spinNum)
+		{
+			if(m_workersPending.load() == 0)
+			{
+				return;
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_doneCondition.wait(lock, [this]() { return m_workersPending.load() == 0; });
+	}
+
+private:
+	static constexpr u32 WorkerSpinCount = 4096;
+
+	static void WorkerThreadMain(WorkerPool *pool, u32 workerIndex)
+	{
+		u32 seenGeneration = 0;
+		for(;;)
+		{
+			WorkerJobFunc *jobFunc = nullptr;
+			void *userData = nullptr;
+
+			// Check for new work with a short spin, then block until woken
+			bool hasJob = false;
+			for(u32 spinNum = 0; spinNum < WorkerSpinCount; ++spinNum)
+			{
+				if(pool->m_jobGeneration.load() != seenGeneration)
+				{
+					hasJob = true;
+					break;
+				}
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(pool->m_mutex);
+				if(!hasJob)
+				{
+					pool->m_wakeCondition.wait(lock, [pool, seenGeneration]() {
+						return pool->m_shutdown || pool->m_jobGeneration.load() != seenGeneration;
+					});
+				}
+				if(pool->m_shutdown)
+				{
+					return;
+				}
+				seenGeneration = pool->m_jobGeneration.load();
+				jobFunc = pool->m_jobFunc;
+				userData = pool->m_jobUserData;
+			}
+
+			jobFunc(userData, workerIndex);
+
+			if(pool->m_workersPending.fetch_sub(1) == 1)
+			{
+				std::lock_guard<std::mutex> lock(pool->m_mutex);
+				pool->m_doneCondition.notify_one();
+			}
+		}
+	}
+
+	u32 m_threadCount;
+	std::thread *m_threads;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wakeCondition;
+	std::condition_variable m_doneCondition;
+
+	WorkerJobFunc *m_jobFunc;
+	void *m_jobUserData;
+	std::atomic<u32> m_jobGeneration;
+	std::atomic<u32> m_workersPending;
+	bool m_shutdown;
+};
+
+
+enum StealResult
+{
+	STEAL_SUCCESS,
+	STEAL_EMPTY,
+	STEAL_ABORT, // Lost a race with another thread, the queue may still have items
+};
+
+// Chase-Lev work stealing deque of u32 items. The owning worker pushes and pops the bottom,
+// any other worker can steal from the top. Capacity is fixed and the queue is reset between uses,
+// so indices never wrap and the buffer never has to grow
+struct alignas(64) WorkStealingDeque
+{
+	void Init(u32 capacity)
+	{
+		m_items = (u32 *)malloc(capacity * sizeof(u32));
+		m_capacity = capacity;
+		Reset();
+	}
+
+	// Only call when no worker is using the queue
+	void Reset()
+	{
+		m_top.store(0);
+		m_bottom.store(0);
+	}
+
+	void Push(u32 item)
+	{
+		s64 bottom = m_bottom.load(std::memory_order_relaxed);
+		Assert(bottom < (s64)m_capacity);
+		m_items[bottom] = item;
+		std::atomic_thread_fence(std::memory_order_release);
+		m_bottom.store(bottom + 1, std::memory_order_relaxed);
+	}
+
+	bool Pop(u32 *outItem)
+	{
+		s64 bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+		m_bottom.store(bottom, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		s64 top = m_top.load(std::memory_order_relaxed);
+
+		bool result = false;
+		if(top <= bottom)
+		{
+			*outItem = m_items[bottom];
+			result = true;
+			if(top == bottom)
+			{
+				// Last item, race any thieves for it
+				result = m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+				m_bottom.store(bottom + 1, std::memory_order_relaxed);
+			}
+		}
+		else
+		{
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
+		}
+		return result;
+	}
+
+	StealResult Steal(u32 *outItem)
+	{
+		s64 top = m_top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		s64 bottom = m_bottom.load(std::memory_order_acquire);
+
+		if(top >= bottom)
+		{
+			return STEAL_EMPTY;
+		}
+
+		u32 item = m_items[top];
+		if(!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			return STEAL_ABORT;
+		}
+		*outItem = item;
+		return STEAL_SUCCESS;
+	}
+
+	std::atomic<s64> m_top;
+	alignas(64) std::atomic<s64> m_bottom;
+	u32 *m_items;
+	u32 m_capacity;
+};